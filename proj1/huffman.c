@@ -0,0 +1,2232 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#include "huffman.h"
+
+// every byte value is a symbol
+#define SYMBOL_MAX 256
+
+// codes are limited to this many bits, which also keeps the decode table
+// (1 << MAX_CODE_LENGTH entries) small enough to live in L1
+#define MAX_CODE_LENGTH 12
+
+// no Huffman tree over 64-bit frequencies gets deeper than this
+#define MAX_TREE_DEPTH 96
+
+// the largest code table (tANS counts)
+#define CODE_TABLE_MAX (2 * SYMBOL_MAX)
+
+// tANS states; symbol counts are scaled to add up to the table size, so a
+// symbol costs log2(TANS_TABLE_SIZE / count) bits, fractions included
+#define TANS_TABLE_LOG 11
+#define TANS_TABLE_SIZE (1 << TANS_TABLE_LOG)
+
+// LZ77 front end (METHOD_LZ): a match is at least LZ_MIN_MATCH bytes long
+// and starts less than LZ_WINDOW bytes back. The match finder hashes the
+// next LZ_MIN_MATCH bytes into LZ_HASH_LOG bits, follows the chain of
+// earlier positions with that hash for at most LZ_MAX_CHAIN steps, and
+// stops at the first match of LZ_NICE_MATCH bytes.
+#define LZ_MIN_MATCH 4
+#define LZ_WINDOW (1 << 18)
+#define LZ_HASH_LOG 16
+#define LZ_MAX_CHAIN 16
+#define LZ_NICE_MATCH 128
+
+// after every 2^LZ_SKIP_LOG literals in a row, the match finder moves on one
+// more position at a time
+#define LZ_SKIP_LOG 6
+
+// literal run lengths, match lengths and offsets are coded as a bucket
+// (values below 16 have one each, [2^n, 2^(n+1)) is bucket 12 + n) and the
+// n bits below the top bit, which fits any 32-bit value
+#define LZ_CODES 44
+
+// the histogram kernel spreads its counts over this many tables
+#define HISTOGRAM_BANKS 4
+
+// number of bits resolved by a single decode table lookup; every code is
+// short enough to be resolved by one lookup
+#define DECODE_TABLE_BITS MAX_CODE_LENGTH
+
+// a node of the Huffman tree. All nodes of a tree live in one array (the
+// arena): the leaves first, then the internal nodes in the order they are
+// created, so a node's parent always comes after it.
+struct freq_node {
+    uint64_t freq;
+    int val;        // symbol of a leaf, -1 for internal nodes
+    int parent;     // index of the parent node, -1 for the root
+    int depth;
+} typedef freq_node;
+
+struct symbol_count {
+    uint64_t count;
+    int symbol;
+} typedef symbol_count;
+
+// one slot of the decode table: the symbol whose code is a prefix of the
+// looked up bits, and the length of that code
+struct decode_entry {
+    unsigned char val;
+    unsigned char len;
+} typedef decode_entry;
+
+// one state of the tANS decode table: the symbol it decodes to, and the
+// next state, which is `base` plus the next `bits` bits of the stream
+struct tans_entry {
+    uint16_t base;
+    unsigned char symbol;
+    unsigned char bits;
+} typedef tans_entry;
+
+// a block is either Huffman or tANS coded, so the two tables share memory
+struct decode_table {
+    union {
+        decode_entry entries[1 << DECODE_TABLE_BITS];
+        tans_entry tans[TANS_TABLE_SIZE];
+    };
+} typedef decode_table;
+
+// tANS encoding of one symbol from state x (in [TANS_TABLE_SIZE,
+// 2 * TANS_TABLE_SIZE)): the low (x + delta_bits) >> 16 bits of x are
+// written out, and the rest of x picks the next state from
+// states[(x >> bits) + delta_state]
+struct tans_symbol {
+    uint32_t delta_bits;
+    int delta_state;
+} typedef tans_symbol;
+
+struct tans_encoder {
+    tans_symbol symbols[SYMBOL_MAX];
+    uint16_t states[TANS_TABLE_SIZE];
+} typedef tans_encoder;
+
+// packs codes MSB-first into a 64-bit accumulator; the first `64 - free`
+// bits of `bits` are pending output, which goes to `out` 8 bytes at a time
+struct bit_writer {
+    unsigned char *out;
+    uint64_t bits;
+    int free;
+} typedef bit_writer;
+
+// where the parts of an encoded block are, see read_block_layout()
+struct block_layout {
+    int method;
+    const unsigned char *code_table;
+    size_t sync_interval, sync_count;
+    int streams;
+    const unsigned char *sync_table;
+    const unsigned char *stream_data[MAX_STREAMS];
+    size_t stream_sizes[MAX_STREAMS];
+} typedef block_layout;
+
+// reads a MSB-first bitstream; the next unread bit is the top bit of `bits`
+struct bit_reader {
+    const unsigned char *next, *end;
+    uint64_t bits;
+    int count;
+} typedef bit_reader;
+// an LZ77 sequence: `literal_length` bytes coded one by one, then a copy
+// of `match_length` bytes from `offset` bytes back. A match length of 0
+// marks literals at the end of a block, with no match after them.
+struct lz_sequence {
+    uint32_t literal_length;
+    uint32_t match_length;
+    uint32_t offset;
+} typedef lz_sequence;
+
+struct huffman_context {
+    decode_table table;
+    tans_encoder tans;
+
+    // tANS encoding collects the bits of a segment here
+    uint16_t *scratch;
+    size_t scratch_size;
+
+    // LZ77 match finder: the latest position of every hash, and for every
+    // position in the window the one before it with the same hash
+    int32_t *lz_head;
+    int32_t *lz_prev;
+    lz_sequence *sequences;
+    size_t sequences_size;
+
+    // decode tables of an LZ block besides the literals (in `table`): run
+    // lengths, match lengths and offsets
+    decode_table lz_tables[3];
+
+    // an LZ block can't be decoded from the middle, so a range of one is
+    // decoded here from the start of the block
+    unsigned char *block_buffer;
+    size_t block_buffer_size;
+};
+
+void heap_push(int heap[], int *heap_size, freq_node nodes[], int node);
+int heap_pop(int heap[], int *heap_size, freq_node nodes[]);
+void print_bin(unsigned int val, int size);
+
+void count_frequencies(const unsigned char *data, size_t size, uint64_t counts[]);
+void count_banked(const unsigned char *data, size_t size, uint32_t banks[][SYMBOL_MAX]);
+void build_code_lengths(uint64_t counts[], int symbols, int code_lengths[]);
+void generate_code_lengths(freq_node nodes[], int node_count, int code_lengths[]);
+void limit_code_lengths(int code_lengths[], uint64_t counts[], int symbols);
+void generate_canonical_codes(int code_lengths[], int symbols, unsigned int codes[]);
+
+void normalize_counts(uint64_t counts[], size_t total, int normalized[]);
+void spread_symbols(int normalized[], unsigned char spread[]);
+void build_tans_encoder(int normalized[], tans_encoder *enc);
+void build_tans_decoder(int normalized[], decode_table *table);
+void tans_encode(const unsigned char *data, size_t count, tans_encoder *enc, uint16_t scratch[], bit_writer *bw);
+void tans_decode(bit_reader *br, decode_table *table, unsigned char *out, size_t skip, size_t count);
+int high_bit(uint32_t val);
+
+int lz_reserve(huffman_context *ctx, size_t size);
+size_t lz_parse(huffman_context *ctx, const unsigned char *data, size_t size);
+uint32_t lz_hash(const unsigned char *data);
+size_t lz_match_length(const unsigned char *a, const unsigned char *b, const unsigned char *end);
+int lz_code(uint32_t val);
+void lz_put(bit_writer *bw, uint32_t val, unsigned int codes[], int code_lengths[]);
+uint32_t lz_get(bit_reader *br, decode_table *table);
+
+void write_block_header(unsigned char *out, size_t size, size_t payload_size, huffman_params *params);
+int read_block_header(const unsigned char *data, size_t data_size, size_t *size, size_t *payload_size);
+int read_block_layout(const unsigned char *data, size_t size, size_t payload_size, block_layout *layout);
+int read_code_lengths(const unsigned char *code_table, int symbols, int code_lengths[]);
+int read_tans_counts(const unsigned char *code_table, int normalized[]);
+uint64_t block_offset(const unsigned char *data, size_t data_size, archive_info *info, uint32_t block);
+
+size_t encode_huffman_block(const unsigned char *data, size_t size, huffman_params *params, uint64_t counts[], unsigned char *out, double stage_times[], double start);
+size_t encode_tans_block(huffman_context *ctx, const unsigned char *data, size_t size, huffman_params *params, uint64_t counts[], unsigned char *out, double stage_times[], double start);
+size_t encode_lz_block(huffman_context *ctx, const unsigned char *data, size_t size, huffman_params *params, uint64_t counts[], unsigned char *out, double stage_times[], double start);
+size_t stream_bound(size_t size, int streams);
+
+void build_decode_table(decode_table *table, unsigned int codes[], int code_lengths[], int symbols);
+void decode_symbols(bit_reader *br, decode_table *table, unsigned char *out, size_t count);
+void decode_interleaved(bit_reader br[], int streams, decode_table *table, unsigned char *out, size_t count, int first);
+unsigned char decode_symbol(bit_reader *br, decode_table *table);
+void skip_symbols(bit_reader *br, decode_table *table, size_t count);
+size_t decode_lz_block(huffman_context *ctx, block_layout *layout, size_t size, unsigned char *out, size_t stop, double stage_times[], double start);
+size_t decode_block_range(huffman_context *ctx, const unsigned char *data, size_t data_size, size_t start, size_t length, unsigned char *out);
+
+void bw_init(bit_writer *bw, unsigned char *out);
+void bw_put(bit_writer *bw, unsigned int code, int len);
+void bw_flush(bit_writer *bw);
+
+void br_init(bit_reader *br, const unsigned char *data, size_t size);
+void br_init_at(bit_reader *br, const unsigned char *data, size_t size, uint64_t bit_offset);
+void br_refill(bit_reader *br);
+
+double lap(double stage_times[], int stage, double start);
+
+huffman_context *huffman_create(void) {
+    // the decode table is probed for every symbol, so it starts on a cache
+    // line (aligned_alloc() wants a multiple of the alignment)
+    huffman_context *ctx = aligned_alloc(64, (sizeof(huffman_context) + 63) & ~(size_t)63);
+
+    if (ctx) {
+        ctx->scratch = NULL;
+        ctx->scratch_size = 0;
+        ctx->lz_head = NULL;
+        ctx->lz_prev = NULL;
+        ctx->sequences = NULL;
+        ctx->sequences_size = 0;
+        ctx->block_buffer = NULL;
+        ctx->block_buffer_size = 0;
+    }
+
+    return ctx;
+}
+
+void huffman_free(huffman_context *ctx) {
+    if (!ctx) return;
+
+    free(ctx->scratch);
+    free(ctx->lz_head);
+    free(ctx->lz_prev);
+    free(ctx->sequences);
+    free(ctx->block_buffer);
+    free(ctx);
+}
+
+void huffman_default_params(huffman_params *params) {
+    params->block_size = DEFAULT_BLOCK_SIZE;
+    params->sync_interval = DEFAULT_SYNC_INTERVAL;
+    params->streams = 1;
+    params->method = METHOD_HUFFMAN;
+}
+
+// returns 1 if `params` describe an archive this codec can write
+int check_params(huffman_params *params) {
+    if (params->block_size == 0 || params->block_size > MAX_BLOCK_SIZE) return 0;
+    if (params->streams != 1 && params->streams != MAX_STREAMS) return 0;
+    if (params->method != METHOD_HUFFMAN && params->method != METHOD_TANS && params->method != METHOD_LZ) return 0;
+    if (params->sync_interval > MAX_BLOCK_SIZE) return 0;
+
+    // whole KB, so every sync point starts on stream 0
+    if (params->sync_interval % MIN_SYNC_INTERVAL != 0) return 0;
+
+    // tANS and LZ blocks are a single stream
+    if (params->method != METHOD_HUFFMAN && params->streams != 1) return 0;
+
+    return 1;
+}
+
+size_t huffman_compress_bound(size_t size, huffman_params *params) {
+    // no bound without a valid block size to divide by
+    if (!check_params(params)) return 0;
+
+    size_t block_count = (size + params->block_size - 1) / params->block_size;
+    size_t last = size - (block_count > 0 ? (block_count - 1) * params->block_size : 0);
+
+    // every block but the last is full
+    size_t bound = HEADER_SIZE + block_count * 8;
+
+    if (block_count > 0) bound += (block_count - 1) * encode_bound(params->block_size) + encode_bound(last);
+
+    return bound;
+}
+
+size_t huffman_compress(huffman_context *ctx, huffman_params *params, const void *src, size_t src_size, void *dst, size_t dst_capacity) {
+    const unsigned char *data = src;
+    unsigned char *out = dst;
+
+    if (!check_params(params) || dst_capacity < huffman_compress_bound(src_size, params)) return 0;
+
+    archive_info info;
+    info.flags = 0;
+    info.block_size = params->block_size;
+    info.size = src_size;
+    info.block_count = (src_size + params->block_size - 1) / params->block_size;
+
+    write_header(out, &info);
+
+    // the blocks follow the index
+    size_t offset = HEADER_SIZE + (size_t)info.block_count * 8;
+
+    for (uint32_t i = 0; i < info.block_count; i++) {
+        size_t start = (size_t)i * params->block_size;
+        size_t n = src_size - start < params->block_size ? src_size - start : params->block_size;
+
+        put_le(out + HEADER_SIZE + (size_t)i * 8, offset, 8);
+
+        size_t encoded_size = encode_block(ctx, data + start, n, params, out + offset);
+
+        if (encoded_size == 0) return 0;
+
+        offset += encoded_size;
+    }
+
+    return offset;
+}
+
+// the file offset of block `block` of a mapped archive, looked up in the
+// index or found by walking a streamed archive. Returns 0 if the archive
+// is truncated.
+uint64_t block_offset(const unsigned char *data, size_t data_size, archive_info *info, uint32_t block) {
+    if (!(info->flags & FLAG_STREAMED)) {
+        if ((data_size - HEADER_SIZE) / 8 <= block) return 0;
+
+        uint64_t offset = get_le(data + HEADER_SIZE + (size_t)block * 8, 8);
+
+        return offset < data_size ? offset : 0;
+    }
+
+    uint64_t offset = HEADER_SIZE;
+
+    for (uint32_t i = 0; i <= block; i++) {
+        if (data_size - offset < BLOCK_HEADER_SIZE) return 0;
+
+        size_t size = get_le(data + offset, 4);
+        size_t payload_size = get_le(data + offset + 4, 4);
+
+        if (size == 0 || data_size - offset - BLOCK_HEADER_SIZE < payload_size) return 0;
+        if (i == block) return offset;
+
+        offset += BLOCK_HEADER_SIZE + payload_size;
+    }
+
+    return 0;
+}
+
+int huffman_decompressed_size(const void *src, size_t src_size, uint64_t *size) {
+    const unsigned char *data = src;
+    archive_info info;
+
+    if (src_size < HEADER_SIZE || !read_header(data, &info)) return 0;
+
+    if (!(info.flags & FLAG_STREAMED)) {
+        *size = info.size;
+        return 1;
+    }
+
+    // a streamed archive only knows its size at the end
+    uint64_t offset = HEADER_SIZE;
+
+    *size = 0;
+
+    while (1) {
+        if (src_size - offset < 8) return 0;
+
+        size_t block_size = get_le(data + offset, 4);
+        size_t payload_size = get_le(data + offset + 4, 4);
+
+        if (block_size == 0) return 1;
+        if (src_size - offset < BLOCK_HEADER_SIZE + payload_size) return 0;
+
+        *size += block_size;
+        offset += BLOCK_HEADER_SIZE + payload_size;
+    }
+}
+
+int huffman_decompress(huffman_context *ctx, const void *src, size_t src_size, void *dst, size_t dst_capacity, size_t *dst_size) {
+    const unsigned char *data = src;
+    unsigned char *out = dst;
+    archive_info info;
+
+    if (src_size < HEADER_SIZE || !read_header(data, &info)) return 0;
+
+    // the blocks are stored in order, so they are simply decoded one after
+    // the other
+    uint64_t offset = HEADER_SIZE;
+    size_t done = 0;
+
+    if (!(info.flags & FLAG_STREAMED)) {
+        if ((src_size - HEADER_SIZE) / 8 < info.block_count) return 0;
+
+        offset += (uint64_t)info.block_count * 8;
+    }
+
+    while (1) {
+        if (!(info.flags & FLAG_STREAMED) && done == info.size) break;
+        if (src_size - offset < 8) return 0;
+
+        size_t size = get_le(data + offset, 4);
+        size_t payload_size = get_le(data + offset + 4, 4);
+
+        // a streamed archive ends with an empty block
+        if (size == 0 && (info.flags & FLAG_STREAMED)) break;
+
+        if (size == 0 || size > info.block_size || size > dst_capacity - done) return 0;
+        if (decode_block(ctx, data + offset, src_size - offset, out + done, size) != size) return 0;
+
+        done += size;
+        offset += BLOCK_HEADER_SIZE + payload_size;
+    }
+
+    *dst_size = done;
+
+    return 1;
+}
+
+int huffman_decompress_range(huffman_context *ctx, const void *src, size_t src_size, uint64_t offset, size_t length, void *dst) {
+    const unsigned char *data = src;
+    unsigned char *out = dst;
+    archive_info info;
+    size_t done = 0;
+
+    if (src_size < HEADER_SIZE || !read_header(data, &info)) return 0;
+
+    // the size of an indexed archive is known up front, a streamed one is
+    // checked block by block
+    if (!(info.flags & FLAG_STREAMED) && (offset > info.size || length > info.size - offset)) return 0;
+
+    while (done < length) {
+        uint64_t block = (offset + done) / info.block_size;
+        size_t start = (offset + done) % info.block_size;
+        size_t n = info.block_size - start < length - done ? info.block_size - start : length - done;
+
+        if (block > UINT32_MAX) return 0;
+
+        uint64_t block_start = block_offset(data, src_size, &info, block);
+
+        if (block_start == 0) return 0;
+        if (decode_block_range(ctx, data + block_start, src_size - block_start, start, n, out + done) != n) return 0;
+
+        done += n;
+    }
+
+    return 1;
+}
+
+// the most bytes encode_block() can produce for `size` bytes of input, plus
+// room for the largest code table, the densest sync table and every
+// stream's bit writer's 8-byte stores
+size_t encode_bound(size_t size) {
+    return BLOCK_HEADER_SIZE + CODE_TABLE_MAX + 4 * (MAX_STREAMS - 1) + 4 * MAX_STREAMS * (size / MIN_SYNC_INTERVAL) +
+           (size + MAX_STREAMS) * MAX_CODE_LENGTH / 8 + 9 * MAX_STREAMS;
+}
+
+// the most bytes a single one of `streams` streams of a block can take
+size_t stream_bound(size_t size, int streams) {
+    return ((size + streams - 1) / streams * MAX_CODE_LENGTH + 7) / 8 + 8;
+}
+
+// encode one block with its own code table into `out`, returns the number
+// of bytes written
+size_t encode_block(huffman_context *ctx, const unsigned char *data, size_t size, huffman_params *params, unsigned char *out) {
+    return encode_block_timed(ctx, data, size, params, out, NULL);
+}
+
+// encode_block() that also adds the time spent in every stage to
+// `stage_times` (if not NULL)
+size_t encode_block_timed(huffman_context *ctx, const unsigned char *data, size_t size, huffman_params *params, unsigned char *out, double stage_times[]) {
+    uint64_t counts[SYMBOL_MAX];
+    double start = stage_times ? now_seconds() : 0;
+
+    // both coders start from the byte counts
+    count_frequencies(data, size, counts);
+    start = lap(stage_times, STAGE_HISTOGRAM, start);
+
+    if (params->method == METHOD_TANS) {
+        return encode_tans_block(ctx, data, size, params, counts, out, stage_times, start);
+    }
+
+    if (params->method == METHOD_LZ) {
+        return encode_lz_block(ctx, data, size, params, counts, out, stage_times, start);
+    }
+
+    return encode_huffman_block(data, size, params, counts, out, stage_times, start);
+}
+
+// encode the rest of encode_block() with a Huffman code, the stage times
+// (if any) continue from `start`
+size_t encode_huffman_block(const unsigned char *data, size_t size, huffman_params *params, uint64_t counts[], unsigned char *out, double stage_times[], double start) {
+    int code_lengths[SYMBOL_MAX] = { 0 };
+    unsigned int codes[SYMBOL_MAX] = { 0 };
+
+    build_code_lengths(counts, SYMBOL_MAX, code_lengths);
+    start = lap(stage_times, STAGE_TREE, start);
+
+    // only the code lengths are kept from the tree: the codes themselves are
+    // reassigned canonically so the decoder can rebuild them from the header
+    generate_canonical_codes(code_lengths, SYMBOL_MAX, codes);
+    start = lap(stage_times, STAGE_CODEGEN, start);
+
+    int streams = params->streams;
+    size_t sync_interval = params->sync_interval;
+    size_t sync_count = sync_interval > 0 && size > 0 ? (size - 1) / sync_interval : 0;
+
+    unsigned char *code_table = out + BLOCK_HEADER_SIZE;
+    unsigned char *jump_table = code_table + SYMBOL_MAX;
+    unsigned char *sync_table = jump_table + 4 * (streams - 1);
+
+    for (int i = 0; i < SYMBOL_MAX; i++) {
+        code_table[i] = code_lengths[i];
+    }
+    unsigned char *stream_start = sync_table + 4 * streams * sync_count;
+
+    // every stream is written to its own worst-case sized region first and
+    // moved into place once the sizes are known
+    size_t region_size = stream_bound(size, streams);
+    bit_writer bw[MAX_STREAMS];
+
+    for (int j = 0; j < streams; j++) {
+        bw_init(&bw[j], stream_start + j * region_size);
+    }
+
+    // encode the block one sync interval at a time, noting where each one
+    // after the first starts. Intervals are whole KB, so every one of them
+    // starts on stream 0.
+    for (size_t start = 0; start < size; start += sync_interval) {
+        size_t end = sync_interval == 0 || size - start < sync_interval ? size : start + sync_interval;
+
+        if (start > 0) {
+            unsigned char *entry = sync_table + 4 * streams * (start / sync_interval - 1);
+
+            for (int j = 0; j < streams; j++) {
+                uint64_t bit_offset = (uint64_t)(bw[j].out - (stream_start + j * region_size)) * 8 + 64 - bw[j].free;
+
+                put_le(entry + 4 * j, bit_offset, 4);
+            }
+        }
+
+        // the writers are copied into locals for the hot loops so they can
+        // stay in registers
+        size_t i = start;
+
+        if (streams == 1) {
+            bit_writer w = bw[0];
+
+            for (; i < end; i++) {
+                unsigned char ch = data[i];
+
+                bw_put(&w, codes[ch], code_lengths[ch]);
+            }
+
+            bw[0] = w;
+        } else {
+            bit_writer w0 = bw[0], w1 = bw[1], w2 = bw[2], w3 = bw[3];
+
+            for (; end - i >= 4; i += 4) {
+                bw_put(&w0, codes[data[i]], code_lengths[data[i]]);
+                bw_put(&w1, codes[data[i + 1]], code_lengths[data[i + 1]]);
+                bw_put(&w2, codes[data[i + 2]], code_lengths[data[i + 2]]);
+                bw_put(&w3, codes[data[i + 3]], code_lengths[data[i + 3]]);
+            }
+
+            bw[0] = w0;
+            bw[1] = w1;
+            bw[2] = w2;
+            bw[3] = w3;
+
+            for (; i < end; i++) {
+                unsigned char ch = data[i];
+
+                bw_put(&bw[i % 4], codes[ch], code_lengths[ch]);
+            }
+        }
+
+        if (end == size) break;
+    }
+
+    // pad the last partial byte of every stream with zeros and close the
+    // gaps between them
+    unsigned char *next = stream_start;
+
+    for (int j = 0; j < streams; j++) {
+        bw_flush(&bw[j]);
+
+        size_t stream_size = bw[j].out - (stream_start + j * region_size);
+
+        memmove(next, stream_start + j * region_size, stream_size);
+        next += stream_size;
+
+        if (j < streams - 1) put_le(jump_table + 4 * j, stream_size, 4);
+    }
+
+    size_t payload_size = next - (out + BLOCK_HEADER_SIZE);
+    write_block_header(out, size, payload_size, params);
+    lap(stage_times, STAGE_ENCODE, start);
+
+    return BLOCK_HEADER_SIZE + payload_size;
+}
+
+// encode the rest of encode_block() with tANS, the stage times (if any)
+// continue from `start`. Every sync interval is a segment of its own, so a
+// decoder can start at any of them.
+size_t encode_tans_block(huffman_context *ctx, const unsigned char *data, size_t size, huffman_params *params, uint64_t counts[], unsigned char *out, double stage_times[], double start) {
+    int normalized[SYMBOL_MAX];
+
+    normalize_counts(counts, size, normalized);
+    start = lap(stage_times, STAGE_TREE, start);
+
+    tans_encoder *enc = &ctx->tans;
+
+    build_tans_encoder(normalized, enc);
+    start = lap(stage_times, STAGE_CODEGEN, start);
+
+    size_t sync_interval = params->sync_interval;
+    size_t sync_count = sync_interval > 0 && size > 0 ? (size - 1) / sync_interval : 0;
+    size_t segment_size = sync_interval > 0 && sync_interval < size ? sync_interval : size;
+
+    unsigned char *code_table = out + BLOCK_HEADER_SIZE;
+    unsigned char *sync_table = code_table + 2 * SYMBOL_MAX;
+    unsigned char *bitstream = sync_table + 4 * sync_count;
+
+    // the scratch buffer only ever grows, so a warm context doesn't allocate
+    if (ctx->scratch_size < segment_size) {
+        free(ctx->scratch);
+        ctx->scratch = malloc(segment_size * sizeof(uint16_t) + 1);
+        if (!ctx->scratch) {
+            ctx->scratch_size = 0;
+            return 0;
+        }
+        ctx->scratch_size = segment_size;
+    }
+    uint16_t *scratch = ctx->scratch;
+
+    for (int i = 0; i < SYMBOL_MAX; i++) {
+        put_le(code_table + 2 * i, normalized[i], 2);
+    }
+
+    bit_writer bw;
+    bw_init(&bw, bitstream);
+
+    for (size_t start = 0; start < size; start += segment_size) {
+        size_t count = size - start < segment_size ? size - start : segment_size;
+
+        if (start > 0) {
+            uint64_t bit_offset = (uint64_t)(bw.out - bitstream) * 8 + 64 - bw.free;
+
+            put_le(sync_table + 4 * (start / segment_size - 1), bit_offset, 4);
+        }
+
+        tans_encode(data + start, count, enc, scratch, &bw);
+    }
+
+    bw_flush(&bw);
+
+    // tANS blocks are always a single stream
+    huffman_params tans_params = *params;
+    tans_params.streams = 1;
+
+    size_t payload_size = bw.out - (out + BLOCK_HEADER_SIZE);
+    write_block_header(out, size, payload_size, &tans_params);
+    lap(stage_times, STAGE_ENCODE, start);
+
+    return BLOCK_HEADER_SIZE + payload_size;
+}
+
+// encode the rest of encode_block() as LZ77 sequences, the stage times (if
+// any) continue from `start`. Literals, run lengths, match lengths and
+// offsets each get a Huffman code of their own. Blocks that LZ77 doesn't
+// make smaller are Huffman coded instead, which also keeps every block
+// within encode_bound().
+size_t encode_lz_block(huffman_context *ctx, const unsigned char *data, size_t size, huffman_params *params, uint64_t counts[], unsigned char *out, double stage_times[], double start) {
+    if (!lz_reserve(ctx, size)) return 0;
+
+    size_t sequence_count = lz_parse(ctx, data, size);
+    lz_sequence *sequences = ctx->sequences;
+    start = lap(stage_times, STAGE_MATCH, start);
+
+    // tables 0-2 are for run lengths, match lengths and offsets
+    uint64_t literal_counts[SYMBOL_MAX] = { 0 };
+    uint64_t lz_counts[3][LZ_CODES] = { { 0 } };
+    uint64_t extra_bits = 0;
+    const unsigned char *next = data;
+
+    for (size_t i = 0; i < sequence_count; i++) {
+        lz_sequence seq = sequences[i];
+        uint32_t values[3] = { seq.literal_length, seq.match_length - LZ_MIN_MATCH, seq.offset - 1 };
+
+        for (uint32_t j = 0; j < seq.literal_length; j++) {
+            literal_counts[next[j]]++;
+        }
+
+        next += seq.literal_length + seq.match_length;
+
+        for (int t = 0; t < (seq.match_length > 0 ? 3 : 1); t++) {
+            int code = lz_code(values[t]);
+
+            lz_counts[t][code]++;
+            if (code >= 16) extra_bits += code - 12;
+        }
+    }
+
+    int literal_lengths[SYMBOL_MAX], huffman_lengths[SYMBOL_MAX];
+    int lz_lengths[3][LZ_CODES];
+
+    build_code_lengths(literal_counts, SYMBOL_MAX, literal_lengths);
+    build_code_lengths(counts, SYMBOL_MAX, huffman_lengths);
+
+    for (int t = 0; t < 3; t++) {
+        build_code_lengths(lz_counts[t], LZ_CODES, lz_lengths[t]);
+    }
+
+    // compare the payload against a plain Huffman block
+    uint64_t lz_bits = extra_bits, huffman_bits = 0;
+
+    for (int i = 0; i < SYMBOL_MAX; i++) {
+        lz_bits += literal_counts[i] * literal_lengths[i];
+        huffman_bits += counts[i] * huffman_lengths[i];
+    }
+
+    for (int t = 0; t < 3; t++) {
+        for (int i = 0; i < LZ_CODES; i++) {
+            lz_bits += lz_counts[t][i] * lz_lengths[t][i];
+        }
+    }
+
+    if (3 * LZ_CODES + (lz_bits + 7) / 8 >= (huffman_bits + 7) / 8) {
+        huffman_params huffman = *params;
+        huffman.method = METHOD_HUFFMAN;
+
+        return encode_huffman_block(data, size, &huffman, counts, out, stage_times, start);
+    }
+
+    start = lap(stage_times, STAGE_TREE, start);
+
+    unsigned int literal_codes[SYMBOL_MAX], lz_codes[3][LZ_CODES];
+    unsigned char *code_table = out + BLOCK_HEADER_SIZE;
+
+    generate_canonical_codes(literal_lengths, SYMBOL_MAX, literal_codes);
+
+    for (int i = 0; i < SYMBOL_MAX; i++) {
+        code_table[i] = literal_lengths[i];
+    }
+    code_table += SYMBOL_MAX;
+
+    for (int t = 0; t < 3; t++) {
+        generate_canonical_codes(lz_lengths[t], LZ_CODES, lz_codes[t]);
+
+        for (int i = 0; i < LZ_CODES; i++) {
+            code_table[i] = lz_lengths[t][i];
+        }
+        code_table += LZ_CODES;
+    }
+
+    start = lap(stage_times, STAGE_CODEGEN, start);
+
+    // a sequence is its run length, its literals, and then (unless it ends
+    // the block) its match length and offset
+    bit_writer w;
+    bw_init(&w, code_table);
+    next = data;
+
+    for (size_t i = 0; i < sequence_count; i++) {
+        lz_sequence seq = sequences[i];
+
+        lz_put(&w, seq.literal_length, lz_codes[0], lz_lengths[0]);
+
+        for (uint32_t j = 0; j < seq.literal_length; j++) {
+            unsigned char ch = next[j];
+
+            bw_put(&w, literal_codes[ch], literal_lengths[ch]);
+        }
+
+        next += seq.literal_length + seq.match_length;
+
+        if (seq.match_length == 0) break;
+
+        lz_put(&w, seq.match_length - LZ_MIN_MATCH, lz_codes[1], lz_lengths[1]);
+        lz_put(&w, seq.offset - 1, lz_codes[2], lz_lengths[2]);
+    }
+
+    bw_flush(&w);
+
+    // LZ blocks are a single stream without sync points
+    huffman_params lz_params = *params;
+    lz_params.streams = 1;
+    lz_params.sync_interval = 0;
+
+    size_t payload_size = w.out - (out + BLOCK_HEADER_SIZE);
+    write_block_header(out, size, payload_size, &lz_params);
+    lap(stage_times, STAGE_ENCODE, start);
+
+    return BLOCK_HEADER_SIZE + payload_size;
+}
+
+// count every byte value in `data` into banks[][value]: consecutive bytes go
+// to different banks, so runs of the same byte don't wait on each other's
+// increments. Counts are 32-bit, `size` must be below 4 GB.
+void count_banked(const unsigned char *data, size_t size, uint32_t banks[][SYMBOL_MAX]) {
+    const unsigned char *end = data + size;
+
+    // 16 bytes per iteration, read as two 8-byte words
+    while (end - data >= 16) {
+        uint64_t a, b;
+        memcpy(&a, data, 8);
+        memcpy(&b, data + 8, 8);
+
+        for (int i = 0; i < 64; i += 16) {
+            banks[0][(a >> i) & 0xFF]++;
+            banks[1][(a >> (i + 8)) & 0xFF]++;
+            banks[2][(b >> i) & 0xFF]++;
+            banks[3][(b >> (i + 8)) & 0xFF]++;
+        }
+
+        data += 16;
+    }
+
+    while (data < end) {
+        banks[0][*data++]++;
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// run detection for count_banked() with AVX2: each 32-byte chunk is compared
+// against its first byte, and a chunk that is one long run is counted with a
+// single add. AVX2 has no conflict-free scatter to count bytes with, so every
+// other chunk still goes through the scalar banked counters.
+__attribute__((target("avx2")))
+void count_runs_avx2(const unsigned char *data, size_t size, uint32_t banks[][SYMBOL_MAX]) {
+    const unsigned char *end = data + size;
+
+    while (end - data >= 32) {
+        __m256i chunk = _mm256_loadu_si256((const __m256i *)data);
+        __m256i first = _mm256_set1_epi8(data[0]);
+
+        if (_mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, first)) == -1) {
+            banks[0][data[0]] += 32;
+        } else {
+            count_banked(data, 32, banks);
+        }
+
+        data += 32;
+    }
+
+    count_banked(data, end - data, banks);
+}
+#endif
+
+// fill counts[] with the number of times every byte value occurs in `data`
+void count_frequencies(const unsigned char *data, size_t size, uint64_t counts[]) {
+    uint32_t banks[HISTOGRAM_BANKS][SYMBOL_MAX];
+
+    memset(banks, 0, sizeof(banks));
+
+#if defined(__x86_64__) || defined(__i386__)
+    if (__builtin_cpu_supports("avx2")) {
+        count_runs_avx2(data, size, banks);
+    } else {
+        count_banked(data, size, banks);
+    }
+#else
+    count_banked(data, size, banks);
+#endif
+
+    // merge the banks
+    for (int i = 0; i < SYMBOL_MAX; i++) {
+        counts[i] = 0;
+
+        for (int b = 0; b < HISTOGRAM_BANKS; b++) {
+            counts[i] += banks[b][i];
+        }
+    }
+}
+
+// build a Huffman tree out of the frequencies of `symbols` symbols and read
+// the length of every code off it. The two least frequent nodes are taken
+// off a binary min-heap and joined until one node is left, O(n log n) in
+// the number of symbols (at most SYMBOL_MAX); all nodes come from one arena
+// on the stack.
+void build_code_lengths(uint64_t counts[], int symbols, int code_lengths[]) {
+    int leaves = 0;
+
+    for (int i = 0; i < symbols; i++) {
+        code_lengths[i] = 0;
+
+        if (counts[i] != 0) leaves++;
+    }
+
+    if (leaves == 0) return;
+
+    // a tree with n leaves has 2n - 1 nodes; the heap never holds more
+    // than the n leaves
+    freq_node nodes[2 * SYMBOL_MAX - 1];
+    int heap[SYMBOL_MAX];
+    int node_count = 0, heap_size = 0;
+
+    for (int i = 0; i < symbols; i++) {
+        if (counts[i] == 0) continue;
+
+        nodes[node_count].freq = counts[i];
+        nodes[node_count].val = i;
+        nodes[node_count].parent = -1;
+
+        heap_push(heap, &heap_size, nodes, node_count++);
+    }
+
+    while (heap_size > 1) {
+        // pop the two least frequent nodes
+        int left = heap_pop(heap, &heap_size, nodes);
+        int right = heap_pop(heap, &heap_size, nodes);
+
+        // create internal node
+        nodes[node_count].freq = nodes[left].freq + nodes[right].freq;
+        nodes[node_count].val = -1;
+        nodes[node_count].parent = -1;
+
+        nodes[left].parent = nodes[right].parent = node_count;
+
+        heap_push(heap, &heap_size, nodes, node_count++);
+    }
+
+    generate_code_lengths(nodes, node_count, code_lengths);
+
+    // a block made of a single byte value still needs a 1-bit code for it
+    if (leaves == 1) {
+        code_lengths[nodes[0].val] = 1;
+    }
+
+    limit_code_lengths(code_lengths, counts, symbols);
+}
+
+// the code length of every symbol is the depth of its leaf. Parents come
+// after their children in the arena, so walking it backwards from the root
+// sees every parent before its children.
+void generate_code_lengths(freq_node nodes[], int node_count, int code_lengths[]) {
+    nodes[node_count - 1].depth = 0;
+
+    for (int i = node_count - 2; i >= 0; i--) {
+        nodes[i].depth = nodes[nodes[i].parent].depth + 1;
+
+        if (nodes[i].val >= 0) {
+            code_lengths[nodes[i].val] = nodes[i].depth;
+        }
+    }
+}
+
+// heap order: by frequency, ties broken by arena index so the tree doesn't
+// depend on the heap layout
+int node_before(freq_node nodes[], int a, int b) {
+    return nodes[a].freq < nodes[b].freq || (nodes[a].freq == nodes[b].freq && a < b);
+}
+
+// add `node` to the min-heap
+void heap_push(int heap[], int *heap_size, freq_node nodes[], int node) {
+    int i = (*heap_size)++;
+
+    // sift up
+    while (i > 0 && node_before(nodes, node, heap[(i - 1) / 2])) {
+        heap[i] = heap[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+
+    heap[i] = node;
+}
+
+// remove and return the least frequent node of the min-heap
+int heap_pop(int heap[], int *heap_size, freq_node nodes[]) {
+    int top = heap[0];
+    int last = heap[--(*heap_size)];
+    int i = 0;
+
+    // sift the last node down from the top
+    while (2 * i + 1 < *heap_size) {
+        int child = 2 * i + 1;
+
+        if (child + 1 < *heap_size && node_before(nodes, heap[child + 1], heap[child])) {
+            child++;
+        }
+
+        if (!node_before(nodes, heap[child], last)) break;
+
+        heap[i] = heap[child];
+        i = child;
+    }
+
+    heap[i] = last;
+
+    return top;
+}
+
+// fill the decode table from the generated codes: every table index that
+// starts with the code of a symbol maps straight to that symbol
+void build_decode_table(decode_table *table, unsigned int codes[], int code_lengths[], int symbols) {
+    // indices that no code covers only show up in corrupt input
+    for (int i = 0; i < (1 << DECODE_TABLE_BITS); i++) {
+        table->entries[i].val = 0;
+        table->entries[i].len = DECODE_TABLE_BITS;
+    }
+
+    for (int i = 0; i < symbols; i++) {
+        int len = code_lengths[i];
+
+        // bytes that don't appear in the text have no code
+        if (len == 0) continue;
+
+        // the code is followed by `DECODE_TABLE_BITS - len` bits of the next
+        // code(s), so all of those combinations decode to this symbol
+        int first = codes[i] << (DECODE_TABLE_BITS - len);
+        int count = 1 << (DECODE_TABLE_BITS - len);
+
+        for (int j = first; j < first + count; j++) {
+            table->entries[j].val = i;
+            table->entries[j].len = len;
+        }
+    }
+}
+
+// decode the block at the start of `data` into `out`, returns the number of
+// bytes decoded or 0 if the block is invalid
+size_t decode_block(huffman_context *ctx, const unsigned char *data, size_t data_size, unsigned char *out, size_t capacity) {
+    return decode_block_timed(ctx, data, data_size, out, capacity, NULL);
+}
+
+// decode_block() that also adds the time spent in every stage to
+// `stage_times` (if not NULL)
+size_t decode_block_timed(huffman_context *ctx, const unsigned char *data, size_t data_size, unsigned char *out, size_t capacity, double stage_times[]) {
+    decode_table *table = &ctx->table;
+    size_t size, payload_size;
+    int code_lengths[SYMBOL_MAX];
+    unsigned int codes[SYMBOL_MAX];
+    double start = stage_times ? now_seconds() : 0;
+    block_layout layout;
+
+    if (!read_block_header(data, data_size, &size, &payload_size) || size > capacity ||
+        !read_block_layout(data, size, payload_size, &layout)) {
+        return 0;
+    }
+
+    if (layout.method == METHOD_LZ) {
+        return decode_lz_block(ctx, &layout, size, out, size, stage_times, start);
+    }
+
+    if (layout.method == METHOD_TANS) {
+        int normalized[SYMBOL_MAX];
+
+        if (!read_tans_counts(layout.code_table, normalized)) return 0;
+
+        build_tans_decoder(normalized, table);
+        start = lap(stage_times, STAGE_DECODE_TABLE, start);
+
+        // the segments follow each other in the stream
+        size_t segment_size = layout.sync_interval > 0 ? layout.sync_interval : size;
+        bit_reader br;
+
+        br_init(&br, layout.stream_data[0], layout.stream_sizes[0]);
+
+        for (size_t i = 0; i < size; i += segment_size) {
+            tans_decode(&br, table, out + i, 0, size - i < segment_size ? size - i : segment_size);
+        }
+
+        lap(stage_times, STAGE_DECODE, start);
+
+        return size;
+    }
+
+    if (!read_code_lengths(layout.code_table, SYMBOL_MAX, code_lengths)) return 0;
+
+    generate_canonical_codes(code_lengths, SYMBOL_MAX, codes);
+    build_decode_table(table, codes, code_lengths, SYMBOL_MAX);
+    start = lap(stage_times, STAGE_DECODE_TABLE, start);
+
+    // a whole block is decoded from the start and doesn't need the sync table
+    bit_reader br[MAX_STREAMS];
+
+    for (int j = 0; j < layout.streams; j++) {
+        br_init(&br[j], layout.stream_data[j], layout.stream_sizes[j]);
+    }
+
+    decode_interleaved(br, layout.streams, table, out, size, 0);
+    lap(stage_times, STAGE_DECODE, start);
+
+    return size;
+}
+
+// decode the LZ block of `size` bytes described by `layout` into `out`,
+// stopping early once the first `stop` bytes are done (a match may still
+// run on past them). Returns the number of bytes decoded or 0 if the block
+// is invalid. The stage times (if any) continue from `start`.
+size_t decode_lz_block(huffman_context *ctx, block_layout *layout, size_t size, unsigned char *out, size_t stop, double stage_times[], double start) {
+    decode_table *tables[4] = { &ctx->table, &ctx->lz_tables[0], &ctx->lz_tables[1], &ctx->lz_tables[2] };
+    const unsigned char *code_table = layout->code_table;
+    int code_lengths[SYMBOL_MAX];
+    unsigned int codes[SYMBOL_MAX];
+
+    for (int t = 0; t < 4; t++) {
+        int symbols = t == 0 ? SYMBOL_MAX : LZ_CODES;
+
+        if (!read_code_lengths(code_table, symbols, code_lengths)) return 0;
+
+        generate_canonical_codes(code_lengths, symbols, codes);
+        build_decode_table(tables[t], codes, code_lengths, symbols);
+        code_table += symbols;
+    }
+
+    start = lap(stage_times, STAGE_DECODE_TABLE, start);
+
+    bit_reader br;
+    unsigned char *next = out, *end = out + size;
+
+    br_init(&br, layout->stream_data[0], layout->stream_sizes[0]);
+
+    while (next < out + stop) {
+        size_t literal_length = lz_get(&br, tables[1]);
+
+        if (literal_length > (size_t)(end - next)) return 0;
+
+        decode_symbols(&br, tables[0], next, literal_length);
+        next += literal_length;
+
+        if (next == end) break;
+
+        size_t match_length = lz_get(&br, tables[2]) + (size_t)LZ_MIN_MATCH;
+        size_t offset = lz_get(&br, tables[3]) + (size_t)1;
+
+        if (offset > (size_t)(next - out) || match_length > (size_t)(end - next)) return 0;
+
+        // copy 8 bytes at a time when the source is far enough back and the
+        // last copy can spill past the match
+        const unsigned char *from = next - offset;
+
+        if (offset >= 8 && (size_t)(end - next) >= match_length + 8) {
+            for (size_t i = 0; i < match_length; i += 8) {
+                memcpy(next + i, from + i, 8);
+            }
+        } else {
+            for (size_t i = 0; i < match_length; i++) {
+                next[i] = from[i];
+            }
+        }
+
+        next += match_length;
+    }
+
+    lap(stage_times, STAGE_DECODE, start);
+
+    return next - out < (ptrdiff_t)stop ? 0 : size;
+}
+
+// decode `count` symbols into `out`
+void decode_symbols(bit_reader *br, decode_table *table, unsigned char *out, size_t count) {
+    unsigned char *end = out + count;
+    decode_entry entry;
+
+    // a refill leaves at least 56 bits in the reader, which covers four codes
+    // of at most MAX_CODE_LENGTH (12) bits
+    while (end - out >= 4) {
+        br_refill(br);
+
+        for (int i = 0; i < 4; i++) {
+            entry = table->entries[br->bits >> (64 - DECODE_TABLE_BITS)];
+            br->bits <<= entry.len;
+            br->count -= entry.len;
+            out[i] = entry.val;
+        }
+
+        out += 4;
+    }
+
+    while (out < end) {
+        br_refill(br);
+
+        entry = table->entries[br->bits >> (64 - DECODE_TABLE_BITS)];
+        br->bits <<= entry.len;
+        br->count -= entry.len;
+        *out++ = entry.val;
+    }
+}
+
+// decode `count` symbols into `out` from `streams` interleaved streams,
+// the first one from stream `first`
+void decode_interleaved(bit_reader br[], int streams, decode_table *table, unsigned char *out, size_t count, int first) {
+    if (streams == 1) {
+        decode_symbols(&br[0], table, out, count);
+        return;
+    }
+
+    size_t i = 0;
+
+    // one symbol at a time until stream 0 is next
+    for (; i < count && (first + i) % 4 != 0; i++) {
+        out[i] = decode_symbol(&br[(first + i) % 4], table);
+    }
+
+    // 16 symbols per round, four from each stream: the four decode chains
+    // don't depend on each other, so their lookups and shifts overlap
+    while (count - i >= 16) {
+        br_refill(&br[0]);
+        br_refill(&br[1]);
+        br_refill(&br[2]);
+        br_refill(&br[3]);
+
+        for (int k = 0; k < 16; k += 4) {
+            for (int j = 0; j < 4; j++) {
+                decode_entry entry = table->entries[br[j].bits >> (64 - DECODE_TABLE_BITS)];
+
+                br[j].bits <<= entry.len;
+                br[j].count -= entry.len;
+                out[i + k + j] = entry.val;
+            }
+        }
+
+        i += 16;
+    }
+
+    for (; i < count; i++) {
+        out[i] = decode_symbol(&br[(first + i) % 4], table);
+    }
+}
+
+// decode a single symbol
+unsigned char decode_symbol(bit_reader *br, decode_table *table) {
+    br_refill(br);
+
+    decode_entry entry = table->entries[br->bits >> (64 - DECODE_TABLE_BITS)];
+    br->bits <<= entry.len;
+    br->count -= entry.len;
+
+    return entry.val;
+}
+
+// decode and drop `count` symbols
+void skip_symbols(bit_reader *br, decode_table *table, size_t count) {
+    while (count >= 4) {
+        br_refill(br);
+
+        for (int i = 0; i < 4; i++) {
+            int len = table->entries[br->bits >> (64 - DECODE_TABLE_BITS)].len;
+
+            br->bits <<= len;
+            br->count -= len;
+        }
+
+        count -= 4;
+    }
+
+    while (count-- > 0) {
+        br_refill(br);
+
+        int len = table->entries[br->bits >> (64 - DECODE_TABLE_BITS)].len;
+
+        br->bits <<= len;
+        br->count -= len;
+    }
+}
+
+// decode `length` bytes from `start` on of the block at the start of `data`,
+// starting from the last sync point before them. Returns the number of
+// bytes decoded or 0 if the block is invalid or too short.
+size_t decode_block_range(huffman_context *ctx, const unsigned char *data, size_t data_size, size_t start, size_t length, unsigned char *out) {
+    decode_table *table = &ctx->table;
+    size_t size, payload_size;
+    int code_lengths[SYMBOL_MAX];
+    unsigned int codes[SYMBOL_MAX];
+    block_layout layout;
+
+    if (!read_block_header(data, data_size, &size, &payload_size) ||
+        !read_block_layout(data, size, payload_size, &layout) ||
+        start > size || length > size - start) {
+        return 0;
+    }
+
+    size_t sync_point = layout.sync_interval > 0 ? start / layout.sync_interval : 0;
+
+    if (sync_point > layout.sync_count) sync_point = layout.sync_count;
+
+    // an LZ block is decoded from its start up to the end of the range
+    if (layout.method == METHOD_LZ) {
+        if (ctx->block_buffer_size < size) {
+            free(ctx->block_buffer);
+            ctx->block_buffer = malloc(size);
+            if (!ctx->block_buffer) {
+                ctx->block_buffer_size = 0;
+                return 0;
+            }
+            ctx->block_buffer_size = size;
+        }
+
+        if (decode_lz_block(ctx, &layout, size, ctx->block_buffer, start + length, NULL, 0) != size) return 0;
+
+        memcpy(out, ctx->block_buffer + start, length);
+
+        return length;
+    }
+
+    // the symbols between the sync point and `start` are decoded and dropped
+    size_t skip = start - sync_point * layout.sync_interval;
+    int streams = layout.streams;
+    bit_reader br[MAX_STREAMS];
+
+    if (layout.method == METHOD_TANS) {
+        int normalized[SYMBOL_MAX];
+
+        if (!read_tans_counts(layout.code_table, normalized)) return 0;
+
+        build_tans_decoder(normalized, table);
+
+        uint64_t bit_offset = sync_point > 0 ? get_le(layout.sync_table + 4 * (sync_point - 1), 4) : 0;
+        size_t segment_size = layout.sync_interval > 0 ? layout.sync_interval : size;
+        size_t segment_start = sync_point * layout.sync_interval;
+        size_t done = 0;
+
+        br_init_at(&br[0], layout.stream_data[0], layout.stream_sizes[0], bit_offset);
+
+        // the range may run on into the following segments
+        while (done < length) {
+            size_t segment_end = size - segment_start < segment_size ? size : segment_start + segment_size;
+            size_t n = segment_end - segment_start - skip < length - done ? segment_end - segment_start - skip : length - done;
+
+            tans_decode(&br[0], table, out + done, skip, n);
+
+            done += n;
+            segment_start = segment_end;
+            skip = 0;
+        }
+
+        return length;
+    }
+
+    if (!read_code_lengths(layout.code_table, SYMBOL_MAX, code_lengths)) return 0;
+
+    generate_canonical_codes(code_lengths, SYMBOL_MAX, codes);
+    build_decode_table(table, codes, code_lengths, SYMBOL_MAX);
+
+    // the skipped symbols are spread evenly over the streams, starting with
+    // stream 0
+    for (int j = 0; j < streams; j++) {
+        uint64_t bit_offset = 0;
+
+        if (sync_point > 0) bit_offset = get_le(layout.sync_table + 4 * (streams * (sync_point - 1) + j), 4);
+
+        br_init_at(&br[j], layout.stream_data[j], layout.stream_sizes[j], bit_offset);
+        skip_symbols(&br[j], table, skip / streams + ((size_t)j < skip % streams));
+    }
+
+    decode_interleaved(br, streams, table, out, length, skip % streams);
+
+    return length;
+}
+
+double now_seconds(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// add the time since `start` to stage_times[stage] (if `stage_times` isn't
+// NULL), returns the current time to start the next stage from
+double lap(double stage_times[], int stage, double start) {
+    if (stage_times == NULL) return 0;
+
+    double now = now_seconds();
+
+    stage_times[stage] += now - start;
+
+    return now;
+}
+
+void bw_init(bit_writer *bw, unsigned char *out) {
+    bw->out = out;
+    bw->bits = 0;
+    bw->free = 64;
+}
+
+// store the 8 bytes of `bits` in big-endian order, so the output keeps the
+// MSB-first bit order
+void store_be64(unsigned char *out, uint64_t bits) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    bits = __builtin_bswap64(bits);
+#endif
+    memcpy(out, &bits, 8);
+}
+
+// append the `len` low bits of `code`; a whole code goes in with one
+// shift, and the accumulator is written out 8 bytes at a time
+void bw_put(bit_writer *bw, unsigned int code, int len) {
+    if (len <= bw->free) {
+        bw->free -= len;
+        bw->bits |= (uint64_t)code << bw->free;
+        return;
+    }
+
+    // the code doesn't fit: top off the accumulator, write it out, and
+    // start the next one with the remaining bits of the code
+    int spill = len - bw->free;
+
+    bw->bits |= (uint64_t)code >> spill;
+
+    store_be64(bw->out, bw->bits);
+    bw->out += 8;
+
+    bw->bits = (uint64_t)code << (64 - spill);
+    bw->free = 64 - spill;
+}
+
+// write out the pending bits, padding the last byte with zeros (the output
+// needs room for 8 bytes, but only the used ones are kept)
+void bw_flush(bit_writer *bw) {
+    store_be64(bw->out, bw->bits);
+    bw->out += (64 - bw->free + 7) / 8;
+
+    bw->bits = 0;
+    bw->free = 64;
+}
+
+// start reading bits from the beginning of `data`
+void br_init(bit_reader *br, const unsigned char *data, size_t size) {
+    br->next = data;
+    br->end = data + size;
+    br->bits = 0;
+    br->count = 0;
+
+    br_refill(br);
+}
+
+// start reading bits `bit_offset` bits into `data`
+void br_init_at(bit_reader *br, const unsigned char *data, size_t size, uint64_t bit_offset) {
+    br_init(br, data + bit_offset / 8, size - bit_offset / 8);
+
+    // a refill leaves at least 56 bits, so the partial byte is all there
+    br->bits <<= bit_offset % 8;
+    br->count -= bit_offset % 8;
+}
+
+// top up the bit buffer to at least 56 bits; past the end of the data the
+// stream is padded with zeros
+void br_refill(bit_reader *br) {
+    if (br->end - br->next >= 8) {
+        // load 8 bytes at once and keep as many whole bytes as fit
+        uint64_t word;
+        memcpy(&word, br->next, 8);
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+        word = __builtin_bswap64(word);
+#endif
+        br->bits |= word >> br->count;
+        br->next += (63 - br->count) >> 3;
+        br->count |= 56;
+        return;
+    }
+
+    while (br->count <= 56) {
+        uint64_t byte = br->next < br->end ? *br->next++ : 0;
+
+        br->bits |= byte << (56 - br->count);
+        br->count += 8;
+    }
+}
+
+// helpers for little-endian header fields
+void put_le(unsigned char *out, uint64_t val, int bytes) {
+    for (int i = 0; i < bytes; i++) {
+        out[i] = val >> (8 * i);
+    }
+}
+
+uint64_t get_le(const unsigned char *data, int bytes) {
+    uint64_t val = 0;
+
+    for (int i = 0; i < bytes; i++) {
+        val |= (uint64_t)data[i] << (8 * i);
+    }
+
+    return val;
+}
+
+void write_header(unsigned char *out, archive_info *info) {
+    memcpy(out, HEADER_MAGIC, 3);
+    out[3] = HEADER_VERSION;
+
+    put_le(out + 4, info->flags, 4);
+    put_le(out + 8, info->block_size, 4);
+    put_le(out + 12, info->size, 8);
+    put_le(out + 20, info->block_count, 4);
+}
+
+// parse the archive header (HEADER_SIZE bytes), returns 0 if it isn't valid
+int read_header(const unsigned char *data, archive_info *info) {
+    if (memcmp(data, HEADER_MAGIC, 3) != 0 || data[3] != HEADER_VERSION) {
+        return 0;
+    }
+
+    info->flags = get_le(data + 4, 4);
+    info->block_size = get_le(data + 8, 4);
+    info->size = get_le(data + 12, 8);
+    info->block_count = get_le(data + 20, 4);
+
+    if (info->block_size == 0 || info->block_size > MAX_BLOCK_SIZE) return 0;
+    if (info->block_count != (info->size + info->block_size - 1) / info->block_size) return 0;
+
+    return 1;
+}
+
+// find the file offset of every block of a mapped archive: an indexed
+// archive lists them, a streamed one is walked block by block (which also
+// fills in its size and block count). Returns NULL if the archive is
+// truncated or a block doesn't fit in `data`.
+uint64_t *read_block_offsets(const unsigned char *data, size_t data_size, archive_info *info) {
+    if (!(info->flags & FLAG_STREAMED)) {
+        if ((data_size - HEADER_SIZE) / 8 < info->block_count) return NULL;
+
+        uint64_t *offsets = malloc(((size_t)info->block_count + 1) * sizeof(uint64_t));
+
+        for (uint32_t i = 0; i < info->block_count; i++) {
+            offsets[i] = get_le(data + HEADER_SIZE + (size_t)i * 8, 8);
+
+            if (offsets[i] > data_size) {
+                free(offsets);
+                return NULL;
+            }
+        }
+
+        return offsets;
+    }
+
+    size_t capacity = 64;
+    uint64_t *offsets = malloc(capacity * sizeof(uint64_t));
+    uint64_t offset = HEADER_SIZE;
+
+    info->size = 0;
+    info->block_count = 0;
+
+    while (1) {
+        if (data_size - offset < 8) {
+            free(offsets);
+            return NULL;
+        }
+
+        size_t size = get_le(data + offset, 4);
+        size_t payload_size = get_le(data + offset + 4, 4);
+
+        if (size == 0) break;
+
+        // every block but the last holds a full block of input
+        if (info->size % info->block_size != 0 || data_size - offset < BLOCK_HEADER_SIZE + payload_size) {
+            free(offsets);
+            return NULL;
+        }
+
+        if (info->block_count == capacity) {
+            capacity *= 2;
+            offsets = realloc(offsets, capacity * sizeof(uint64_t));
+        }
+
+        offsets[info->block_count++] = offset;
+        info->size += size;
+        offset += BLOCK_HEADER_SIZE + payload_size;
+    }
+
+    return offsets;
+}
+
+// write the block header; the decoder needs nothing else to rebuild the codes
+void write_block_header(unsigned char *out, size_t size, size_t payload_size, huffman_params *params) {
+    put_le(out, size, 4);
+    put_le(out + 4, payload_size, 4);
+    put_le(out + 8, params->sync_interval, 4);
+    out[12] = params->streams;
+    out[13] = params->method;
+}
+
+// parse the fixed part of the block header at the start of `data`, returns
+// 0 if the payload doesn't fit in `data`
+int read_block_header(const unsigned char *data, size_t data_size, size_t *size, size_t *payload_size) {
+    if (data_size < BLOCK_HEADER_SIZE) return 0;
+
+    *size = get_le(data, 4);
+    *payload_size = get_le(data + 4, 4);
+
+    if (*payload_size > data_size - BLOCK_HEADER_SIZE) return 0;
+
+    return 1;
+}
+
+// read the code lengths of a Huffman block, returns 0 if they aren't valid
+int read_code_lengths(const unsigned char *code_table, int symbols, int code_lengths[]) {
+    // the lengths must describe a prefix code (Kraft sum <= 1), otherwise
+    // the canonical codes would overflow their lengths
+    int kraft_sum = 0;
+
+    for (int i = 0; i < symbols; i++) {
+        code_lengths[i] = code_table[i];
+
+        if (code_lengths[i] > MAX_CODE_LENGTH) return 0;
+        if (code_lengths[i] > 0) kraft_sum += 1 << (MAX_CODE_LENGTH - code_lengths[i]);
+    }
+
+    if (kraft_sum > (1 << MAX_CODE_LENGTH)) return 0;
+
+    return 1;
+}
+
+// read the normalized counts of a tANS block, returns 0 if they don't add
+// up to the table size
+int read_tans_counts(const unsigned char *code_table, int normalized[]) {
+    int sum = 0;
+
+    for (int i = 0; i < SYMBOL_MAX; i++) {
+        normalized[i] = get_le(code_table + 2 * i, 2);
+        sum += normalized[i];
+    }
+
+    return sum == TANS_TABLE_SIZE;
+}
+
+// find the code table, jump table, sync table and streams in the payload of a block
+// whose header has been read; returns 0 if they don't fit in the payload
+// or a sync point lies past the end of its stream
+int read_block_layout(const unsigned char *data, size_t size, size_t payload_size, block_layout *layout) {
+    int streams = data[12];
+    int method = data[13];
+
+    // no block is encoded empty (the one that ends a streamed archive is
+    // never decoded), and an empty tANS block has no table to build
+    if (size == 0) return 0;
+    if (method != METHOD_HUFFMAN && method != METHOD_TANS && method != METHOD_LZ) return 0;
+    if (streams != 1 && (streams != MAX_STREAMS || method != METHOD_HUFFMAN)) return 0;
+
+    // LZ blocks have no sync points
+    if (method == METHOD_LZ && get_le(data + 8, 4) != 0) return 0;
+
+    size_t code_table_size = SYMBOL_MAX;
+
+    if (method == METHOD_TANS) code_table_size = 2 * SYMBOL_MAX;
+    if (method == METHOD_LZ) code_table_size = SYMBOL_MAX + 3 * LZ_CODES;
+
+    if (payload_size < code_table_size) return 0;
+
+    layout->method = method;
+    layout->code_table = data + BLOCK_HEADER_SIZE;
+
+    layout->streams = streams;
+    layout->sync_interval = get_le(data + 8, 4);
+    layout->sync_count = layout->sync_interval > 0 ? (size - 1) / layout->sync_interval : 0;
+
+    // sync points have to start on stream 0
+    if (layout->sync_interval % streams != 0) return 0;
+
+    const unsigned char *jump_table = layout->code_table + code_table_size;
+    size_t left = payload_size - code_table_size;
+
+    if (left < 4 * (size_t)(streams - 1)) return 0;
+    left -= 4 * (streams - 1);
+
+    if (layout->sync_count > left / (4 * streams)) return 0;
+    left -= 4 * streams * layout->sync_count;
+
+    layout->sync_table = jump_table + 4 * (streams - 1);
+
+    const unsigned char *next = layout->sync_table + 4 * streams * layout->sync_count;
+
+    for (int j = 0; j < streams; j++) {
+        size_t stream_size = j < streams - 1 ? get_le(jump_table + 4 * j, 4) : left;
+
+        if (stream_size > left) return 0;
+
+        layout->stream_data[j] = next;
+        layout->stream_sizes[j] = stream_size;
+        next += stream_size;
+        left -= stream_size;
+    }
+
+    for (size_t k = 0; k < layout->sync_count; k++) {
+        for (int j = 0; j < streams; j++) {
+            if (get_le(layout->sync_table + 4 * (streams * k + j), 4) > (uint64_t)layout->stream_sizes[j] * 8) return 0;
+        }
+    }
+
+    return 1;
+}
+
+// print the code table of an encoded block (debug)
+void print_block_codes(const unsigned char *block, uint32_t index) {
+    int code_lengths[SYMBOL_MAX];
+    unsigned int codes[SYMBOL_MAX];
+    size_t size, payload_size;
+    block_layout layout;
+
+    read_block_header(block, BLOCK_HEADER_SIZE + get_le(block + 4, 4), &size, &payload_size);
+    read_block_layout(block, size, payload_size, &layout);
+
+    fprintf(stderr, "block %u: %zu -> %zu bytes\n", index, size, BLOCK_HEADER_SIZE + payload_size);
+
+    // a tANS block has no codes, only the counts its states are spread by
+    if (layout.method == METHOD_TANS) {
+        fprintf(stderr, "%-8s %s\n", "byte", "count");
+
+        for (int i = 0; i < SYMBOL_MAX; i++) {
+            int count = get_le(layout.code_table + 2 * i, 2);
+
+            if (count == 0) continue;
+
+            if (i > ' ' && i < 127) {
+                fprintf(stderr, "%-8c ", i);
+            } else {
+                fprintf(stderr, "0x%02x     ", i);
+            }
+
+            fprintf(stderr, "%d/%d\n", count, TANS_TABLE_SIZE);
+        }
+
+        return;
+    }
+
+    // an LZ block starts with its literal code, the code lengths of its run
+    // lengths, match lengths and offsets are listed by bucket
+    if (layout.method == METHOD_LZ) {
+        const char *names[3] = { "runs", "matches", "offsets" };
+
+        for (int t = 0; t < 3; t++) {
+            const unsigned char *lengths = layout.code_table + SYMBOL_MAX + t * LZ_CODES;
+
+            fprintf(stderr, "%-8s", names[t]);
+
+            for (int i = 0; i < LZ_CODES; i++) {
+                if (lengths[i] != 0) fprintf(stderr, " %d:%d", i, lengths[i]);
+            }
+
+            fprintf(stderr, "\n");
+        }
+    }
+
+    read_code_lengths(layout.code_table, SYMBOL_MAX, code_lengths);
+    generate_canonical_codes(code_lengths, SYMBOL_MAX, codes);
+
+    fprintf(stderr, "%-8s %-8s %s\n", "byte", "codelen", "code");
+
+    for (int i = 0; i < SYMBOL_MAX; i++) {
+        if (code_lengths[i] == 0) continue;
+
+        if (i > ' ' && i < 127) {
+            fprintf(stderr, "%-8c ", i);
+        } else {
+            fprintf(stderr, "0x%02x     ", i);
+        }
+
+        fprintf(stderr, "%-8d ", code_lengths[i]);
+        print_bin(codes[i], code_lengths[i]);
+        fprintf(stderr, "\n");
+    }
+}
+
+// qsort() comparator for limit_code_lengths()
+int by_decreasing_count(const void *a, const void *b) {
+    const symbol_count *x = a, *y = b;
+
+    if (x->count != y->count) return x->count < y->count ? 1 : -1;
+
+    return x->symbol - y->symbol;
+}
+
+// cap the code lengths at MAX_CODE_LENGTH. Leaves deeper than that are
+// moved up by repeatedly taking two of the deepest leaves, attaching one of
+// them at the level above in place of their parent, and hanging the other
+// one below a shallower leaf (which moves down a level to make room), as in
+// JPEG (ITU T.81, K.3). The adjusted lengths are then handed out again,
+// shortest first, in order of decreasing frequency.
+void limit_code_lengths(int code_lengths[], uint64_t counts[], int symbols) {
+    // frequencies add up to less than 2^64, which bounds the depth of the
+    // tree (the Fibonacci numbers are the worst case) well below this
+    int length_count[MAX_TREE_DEPTH + 1] = { 0 };
+    int max_length = 0;
+
+    for (int i = 0; i < symbols; i++) {
+        length_count[code_lengths[i]]++;
+
+        if (code_lengths[i] > max_length) max_length = code_lengths[i];
+    }
+
+    if (max_length <= MAX_CODE_LENGTH) return;
+
+    for (int len = max_length; len > MAX_CODE_LENGTH; len--) {
+        while (length_count[len] > 0) {
+            int j = len - 2;
+            while (length_count[j] == 0) j--;
+
+            length_count[len] -= 2;
+            length_count[len - 1]++;
+            length_count[j + 1] += 2;
+            length_count[j]--;
+        }
+    }
+
+    // order the symbols by decreasing frequency (ties by symbol value)
+    symbol_count order[SYMBOL_MAX];
+    int used = 0;
+
+    for (int i = 0; i < symbols; i++) {
+        if (code_lengths[i] == 0) continue;
+
+        order[used].count = counts[i];
+        order[used].symbol = i;
+        used++;
+    }
+
+    qsort(order, used, sizeof(symbol_count), by_decreasing_count);
+
+    int next = 0;
+    for (int len = 1; len <= MAX_CODE_LENGTH; len++) {
+        for (int n = 0; n < length_count[len]; n++) {
+            code_lengths[order[next++].symbol] = len;
+        }
+    }
+}
+
+// assign canonical codes from the code lengths alone: shorter codes come
+// first, and codes of equal length are consecutive in symbol order
+void generate_canonical_codes(int code_lengths[], int symbols, unsigned int codes[]) {
+    int length_count[MAX_CODE_LENGTH + 1] = { 0 };
+    unsigned int next_code[MAX_CODE_LENGTH + 1] = { 0 };
+
+    for (int i = 0; i < symbols; i++) {
+        length_count[code_lengths[i]]++;
+    }
+
+    length_count[0] = 0;
+
+    unsigned int code = 0;
+    for (int len = 1; len <= MAX_CODE_LENGTH; len++) {
+        code = (code + length_count[len - 1]) << 1;
+        next_code[len] = code;
+    }
+
+    for (int i = 0; i < symbols; i++) {
+        if (code_lengths[i] != 0) {
+            codes[i] = next_code[code_lengths[i]]++;
+        }
+    }
+}
+
+// scale the byte counts of a block of `total` bytes to add up to
+// TANS_TABLE_SIZE, keeping every byte that occurs at a count of at least 1
+void normalize_counts(uint64_t counts[], size_t total, int normalized[]) {
+    int sum = 0, largest = -1;
+
+    for (int i = 0; i < SYMBOL_MAX; i++) {
+        normalized[i] = 0;
+
+        if (counts[i] == 0) continue;
+
+        normalized[i] = (counts[i] * TANS_TABLE_SIZE + total / 2) / total;
+        if (normalized[i] == 0) normalized[i] = 1;
+
+        sum += normalized[i];
+        if (largest < 0 || counts[i] > counts[largest]) largest = i;
+    }
+
+    if (largest < 0) return;
+
+    // the rounding error goes to the most frequent byte, where it costs the
+    // least; if that would leave it with nothing, the excess is taken off
+    // the largest counts one at a time instead
+    if (normalized[largest] + TANS_TABLE_SIZE - sum >= 1) {
+        normalized[largest] += TANS_TABLE_SIZE - sum;
+        return;
+    }
+
+    while (sum > TANS_TABLE_SIZE) {
+        int max = 0;
+
+        for (int i = 1; i < SYMBOL_MAX; i++) {
+            if (normalized[i] > normalized[max]) max = i;
+        }
+
+        normalized[max]--;
+        sum--;
+    }
+}
+
+// lay out the states of the table: every byte gets as many states as its
+// normalized count, scattered over the table so that each byte's states
+// are spread evenly. The step is odd, so it visits every state once.
+void spread_symbols(int normalized[], unsigned char spread[]) {
+    int step = (TANS_TABLE_SIZE >> 1) + (TANS_TABLE_SIZE >> 3) + 3;
+    int pos = 0;
+
+    for (int i = 0; i < SYMBOL_MAX; i++) {
+        for (int k = 0; k < normalized[i]; k++) {
+            spread[pos] = i;
+            pos = (pos + step) & (TANS_TABLE_SIZE - 1);
+        }
+    }
+}
+
+// build the encoding transforms: the states of byte i, in table order, are
+// listed in states[] starting at the sum of the counts before it
+void build_tans_encoder(int normalized[], tans_encoder *enc) {
+    unsigned char spread[TANS_TABLE_SIZE];
+    int next[SYMBOL_MAX];
+    int total = 0;
+
+    spread_symbols(normalized, spread);
+
+    for (int i = 0; i < SYMBOL_MAX; i++) {
+        next[i] = total;
+        total += normalized[i];
+    }
+
+    for (int u = 0; u < TANS_TABLE_SIZE; u++) {
+        enc->states[next[spread[u]]++] = TANS_TABLE_SIZE + u;
+    }
+
+    total = 0;
+
+    for (int i = 0; i < SYMBOL_MAX; i++) {
+        int count = normalized[i];
+
+        if (count == 0) {
+            enc->symbols[i].delta_bits = 0;
+            enc->symbols[i].delta_state = 0;
+            continue;
+        }
+
+        // a state x leaves (x + delta_bits) >> 16 bits, the least that gets
+        // it into [count, 2 * count)
+        if (count == 1) {
+            enc->symbols[i].delta_bits = (TANS_TABLE_LOG << 16) - TANS_TABLE_SIZE;
+            enc->symbols[i].delta_state = total - 1;
+        } else {
+            int max_bits = TANS_TABLE_LOG - high_bit(count - 1);
+
+            enc->symbols[i].delta_bits = (max_bits << 16) - (count << max_bits);
+            enc->symbols[i].delta_state = total - count;
+        }
+
+        total += count;
+    }
+}
+
+// build the decode table: the states of a byte, in table order, continue
+// from the values count .. 2 * count - 1, which are scaled back up into
+// the table by reading bits
+void build_tans_decoder(int normalized[], decode_table *table) {
+    unsigned char spread[TANS_TABLE_SIZE];
+    int next[SYMBOL_MAX];
+
+    spread_symbols(normalized, spread);
+
+    for (int i = 0; i < SYMBOL_MAX; i++) {
+        next[i] = normalized[i];
+    }
+
+    for (int u = 0; u < TANS_TABLE_SIZE; u++) {
+        int symbol = spread[u];
+        int n = next[symbol]++;
+        int bits = TANS_TABLE_LOG - high_bit(n);
+
+        table->tans[u].base = (n << bits) - TANS_TABLE_SIZE;
+        table->tans[u].symbol = symbol;
+        table->tans[u].bits = bits;
+    }
+}
+
+// encode `count` bytes as one segment: the first state the decoder needs,
+// then the bits of every byte in order. tANS encodes backwards, so the bits
+// are collected in `scratch` (value << 4 | length, one per byte) first.
+void tans_encode(const unsigned char *data, size_t count, tans_encoder *enc, uint16_t scratch[], bit_writer *bw) {
+    uint32_t state = TANS_TABLE_SIZE;
+
+    for (size_t i = count; i-- > 0; ) {
+        tans_symbol *sym = &enc->symbols[data[i]];
+        int bits = (state + sym->delta_bits) >> 16;
+
+        scratch[i] = (state & ((1 << bits) - 1)) << 4 | bits;
+        state = enc->states[(state >> bits) + sym->delta_state];
+    }
+
+    bw_put(bw, state - TANS_TABLE_SIZE, TANS_TABLE_LOG);
+
+    for (size_t i = 0; i < count; i++) {
+        bw_put(bw, scratch[i] >> 4, scratch[i] & 0xf);
+    }
+}
+
+// decode one segment: read its first state, decode and drop `skip` bytes
+// and decode the next `count` into `out`
+void tans_decode(bit_reader *br, decode_table *table, unsigned char *out, size_t skip, size_t count) {
+    tans_entry *entries = table->tans;
+    tans_entry entry;
+
+    br_refill(br);
+
+    uint32_t state = br->bits >> (64 - TANS_TABLE_LOG);
+    br->bits <<= TANS_TABLE_LOG;
+    br->count -= TANS_TABLE_LOG;
+
+    // a state step reads at most TANS_TABLE_LOG (11) bits, so a refill
+    // covers four of them. Reading 0 bits has to come out as 0, hence the
+    // split shift.
+    while (skip > 0) {
+        br_refill(br);
+
+        entry = entries[state];
+        state = entry.base + (br->bits >> (63 - entry.bits) >> 1);
+        br->bits <<= entry.bits;
+        br->count -= entry.bits;
+        skip--;
+    }
+
+    unsigned char *end = out + count;
+
+    while (end - out >= 4) {
+        br_refill(br);
+
+        for (int i = 0; i < 4; i++) {
+            entry = entries[state];
+            out[i] = entry.symbol;
+            state = entry.base + (br->bits >> (63 - entry.bits) >> 1);
+            br->bits <<= entry.bits;
+            br->count -= entry.bits;
+        }
+
+        out += 4;
+    }
+
+    while (out < end) {
+        br_refill(br);
+
+        entry = entries[state];
+        *out++ = entry.symbol;
+        state = entry.base + (br->bits >> (63 - entry.bits) >> 1);
+        br->bits <<= entry.bits;
+        br->count -= entry.bits;
+    }
+}
+
+// index of the highest set bit of a nonzero value
+int high_bit(uint32_t val) {
+    return 31 - __builtin_clz(val);
+}
+
+// make sure `ctx` has the match finder tables and room for the sequences
+// of a block of `size` bytes, returns 0 if out of memory
+int lz_reserve(huffman_context *ctx, size_t size) {
+    if (!ctx->lz_head) {
+        ctx->lz_head = malloc(sizeof(int32_t) << LZ_HASH_LOG);
+        ctx->lz_prev = malloc(sizeof(int32_t) * LZ_WINDOW);
+    }
+
+    if (!ctx->lz_head || !ctx->lz_prev) return 0;
+
+    // every sequence but the last holds a match
+    size_t max_sequences = size / LZ_MIN_MATCH + 1;
+
+    if (ctx->sequences_size < max_sequences) {
+        free(ctx->sequences);
+        ctx->sequences = malloc(max_sequences * sizeof(lz_sequence));
+        if (!ctx->sequences) {
+            ctx->sequences_size = 0;
+            return 0;
+        }
+        ctx->sequences_size = max_sequences;
+    }
+
+    return 1;
+}
+
+// split `data` into LZ77 sequences (into ctx->sequences), taking the longest
+// match the hash chains turn up at every position. Returns the number of
+// sequences.
+size_t lz_parse(huffman_context *ctx, const unsigned char *data, size_t size) {
+    int32_t *head = ctx->lz_head, *prev = ctx->lz_prev;
+    lz_sequence *sequences = ctx->sequences;
+    size_t count = 0, anchor = 0, pos = 0;
+
+    // chains only ever lead to positions of this block
+    memset(head, 0xFF, sizeof(int32_t) << LZ_HASH_LOG);
+
+    // a match can start wherever there are LZ_MIN_MATCH bytes left to hash
+    size_t last = size >= LZ_MIN_MATCH ? size - LZ_MIN_MATCH : 0;
+
+    while (size >= LZ_MIN_MATCH && pos <= last) {
+        uint32_t hash = lz_hash(data + pos);
+        int32_t candidate = head[hash];
+        size_t best_length = 0, best_offset = 0;
+
+        for (int steps = 0; candidate >= 0 && pos - candidate < LZ_WINDOW && steps < LZ_MAX_CHAIN; steps++) {
+            // a candidate can only beat the best match if it also matches
+            // the byte after it
+            if (data[candidate + best_length] != data[pos + best_length]) {
+                candidate = prev[candidate & (LZ_WINDOW - 1)];
+                continue;
+            }
+
+            size_t length = lz_match_length(data + candidate, data + pos, data + size);
+
+            if (length > best_length) {
+                best_length = length;
+                best_offset = pos - candidate;
+
+                if (length >= LZ_NICE_MATCH || pos + length == size) break;
+            }
+
+            candidate = prev[candidate & (LZ_WINDOW - 1)];
+        }
+
+        prev[pos & (LZ_WINDOW - 1)] = head[hash];
+        head[hash] = pos;
+
+        // the longer the search has gone without a match, the more
+        // positions it skips, so incompressible data goes by quickly
+        if (best_length < LZ_MIN_MATCH) {
+            pos += 1 + ((pos - anchor) >> LZ_SKIP_LOG);
+            continue;
+        }
+
+        sequences[count].literal_length = pos - anchor;
+        sequences[count].match_length = best_length;
+        sequences[count].offset = best_offset;
+        count++;
+
+        // the positions inside the match go into the chains as well, so
+        // later matches can start in them
+        size_t match_end = pos + best_length;
+
+        for (pos++; pos < match_end && pos <= last; pos++) {
+            hash = lz_hash(data + pos);
+            prev[pos & (LZ_WINDOW - 1)] = head[hash];
+            head[hash] = pos;
+        }
+
+        pos = match_end;
+        anchor = pos;
+    }
+
+    if (anchor < size) {
+        sequences[count].literal_length = size - anchor;
+        sequences[count].match_length = 0;
+        sequences[count].offset = 0;
+        count++;
+    }
+
+    return count;
+}
+
+// hash of the LZ_MIN_MATCH bytes at `data`
+uint32_t lz_hash(const unsigned char *data) {
+    uint32_t word;
+    memcpy(&word, data, 4);
+
+    return (word * 2654435761u) >> (32 - LZ_HASH_LOG);
+}
+
+// the number of bytes `a` and `b` have in common, `b` being the later one
+// and running until `end`
+size_t lz_match_length(const unsigned char *a, const unsigned char *b, const unsigned char *end) {
+    const unsigned char *start = b;
+
+    // 8 bytes at a time, the first differing byte is found from the lowest
+    // differing bit
+    while (end - b >= 8) {
+        uint64_t x, y;
+        memcpy(&x, a, 8);
+        memcpy(&y, b, 8);
+
+        if (x != y) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+            return b - start + (__builtin_ctzll(x ^ y) >> 3);
+#else
+            return b - start + (__builtin_clzll(x ^ y) >> 3);
+#endif
+        }
+
+        a += 8;
+        b += 8;
+    }
+
+    while (b < end && *a == *b) {
+        a++;
+        b++;
+    }
+
+    return b - start;
+}
+
+// the bucket of a run length, match length or offset
+int lz_code(uint32_t val) {
+    return val < 16 ? (int)val : 12 + high_bit(val);
+}
+
+// write `val` as its bucket's code followed by the bits below its top bit
+void lz_put(bit_writer *bw, uint32_t val, unsigned int codes[], int code_lengths[]) {
+    int code = lz_code(val);
+
+    bw_put(bw, codes[code], code_lengths[code]);
+
+    if (code >= 16) bw_put(bw, val - (1u << (code - 12)), code - 12);
+}
+
+// read a value written by lz_put(); one refill covers the code and its up
+// to 31 extra bits
+uint32_t lz_get(bit_reader *br, decode_table *table) {
+    br_refill(br);
+
+    decode_entry entry = table->entries[br->bits >> (64 - DECODE_TABLE_BITS)];
+    br->bits <<= entry.len;
+    br->count -= entry.len;
+
+    if (entry.val < 16) return entry.val;
+
+    int bits = entry.val - 12;
+    uint32_t val = (1u << bits) | (uint32_t)(br->bits >> (64 - bits));
+
+    br->bits <<= bits;
+    br->count -= bits;
+
+    return val;
+}
+
+// helper for printing binary values
+void print_bin(unsigned int val, int size) {
+    for (int i = 1; i <= size; i++) {
+        fprintf(stderr, "%u", (val >> (size - i)) & 1);
+    }
+}
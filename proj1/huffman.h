@@ -0,0 +1,128 @@
+// in-memory Huffman/tANS codec: buffer-to-buffer compression into the same
+// archive format the huffman_coding tool writes
+#ifndef HUFFMAN_H
+#define HUFFMAN_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// archive layout (all integers little-endian):
+//   header: magic, version, flags (4 bytes), block size (4 bytes), original
+//           size (8 bytes), block count (4 bytes)
+//   index:  file offset of every block (8 bytes each)
+//   blocks: original size (4 bytes), payload size (4 bytes), sync interval
+//           (4 bytes), stream count (1 byte), coding method (1 byte), then
+//           the payload: the code table, the jump table, the sync table and
+//           the bitstreams
+//
+// The code table of a Huffman block is the canonical code length of every
+// byte value (1 byte each). A tANS block has the normalized count of every
+// byte value instead (2 bytes each), and is always a single stream made of
+// one independently coded segment per sync interval. An LZ block is a
+// single stream without sync points; its code table is the code length of
+// every byte value followed by those of the run length, match length and
+// offset buckets (44 bytes each), and the stream is a series of sequences
+// (run length, that many literals, match length, offset) where the last
+// one may end after its literals.
+//
+// A block is coded as 1 or 4 bitstreams that share its code table, byte i
+// going to stream i % streams, so a decoder can follow all of them at once.
+// The jump table holds the size of every stream but the last (4 bytes
+// each).
+//
+// The sync table lets a decoder start in the middle of a block: entry k - 1
+// holds, for every stream, the bit offset (4 bytes) where the code of input
+// byte k * interval starts, for every such byte in the block. An interval of
+// 0 means the block has no sync points.
+//
+// A streamed archive (FLAG_STREAMED) is written without knowing the input
+// size up front: its size and block count are 0, there is no index, and the
+// blocks are followed by an end marker (8 zero bytes).
+#define HEADER_MAGIC "HUF"
+#define HEADER_VERSION 7
+#define HEADER_SIZE 24
+#define BLOCK_HEADER_SIZE 14
+
+#define FLAG_STREAMED 1
+
+#define MAX_STREAMS 4
+
+#define METHOD_HUFFMAN 0
+#define METHOD_TANS 1
+#define METHOD_LZ 2
+
+// the input is split into blocks of this size, each with its own code table
+#define DEFAULT_BLOCK_SIZE (1 << 20)
+#define MAX_BLOCK_SIZE (1 << 30)
+
+// a sync point is recorded every this many input bytes of a block (the
+// interval has to be a whole number of KB)
+#define DEFAULT_SYNC_INTERVAL (64 << 10)
+#define MIN_SYNC_INTERVAL (1 << 10)
+
+// stages timed by encode_block_timed() and decode_block_timed()
+#define STAGE_HISTOGRAM 0
+#define STAGE_TREE 1
+#define STAGE_CODEGEN 2
+#define STAGE_ENCODE 3
+#define STAGE_DECODE_TABLE 4
+#define STAGE_DECODE 5
+#define STAGE_MATCH 6
+#define STAGE_COUNT 7
+
+// how data is encoded; huffman_default_params() fills in the defaults
+struct huffman_params {
+    size_t block_size;
+    size_t sync_interval;
+    int streams;
+    int method;
+} typedef huffman_params;
+
+// tables and scratch memory for encoding and decoding. A context is reused
+// from call to call, so after the first few calls nothing is allocated; it
+// must not be used by two threads at once.
+struct huffman_context typedef huffman_context;
+
+// archive header fields
+struct archive_info {
+    uint32_t flags;
+    uint32_t block_size;
+    uint64_t size;
+    uint32_t block_count;
+} typedef archive_info;
+
+huffman_context *huffman_create(void);
+void huffman_free(huffman_context *ctx);
+void huffman_default_params(huffman_params *params);
+
+// compression writes an indexed archive; it returns the archive size, or 0
+// if the parameters aren't valid or `dst_capacity` is below
+// huffman_compress_bound() (which is 0 too if the parameters aren't valid)
+size_t huffman_compress_bound(size_t size, huffman_params *params);
+size_t huffman_compress(huffman_context *ctx, huffman_params *params, const void *src, size_t src_size, void *dst, size_t dst_capacity);
+
+// the decompression calls take indexed or streamed archives and return 0 if
+// the archive isn't valid or doesn't fit in `dst`
+int huffman_decompressed_size(const void *src, size_t src_size, uint64_t *size);
+int huffman_decompress(huffman_context *ctx, const void *src, size_t src_size, void *dst, size_t dst_capacity, size_t *dst_size);
+int huffman_decompress_range(huffman_context *ctx, const void *src, size_t src_size, uint64_t offset, size_t length, void *dst);
+
+// block-level interface, which the huffman_coding tool uses to spread the
+// blocks of an archive over threads
+size_t encode_bound(size_t size);
+size_t encode_block(huffman_context *ctx, const unsigned char *data, size_t size, huffman_params *params, unsigned char *out);
+size_t encode_block_timed(huffman_context *ctx, const unsigned char *data, size_t size, huffman_params *params, unsigned char *out, double stage_times[]);
+size_t decode_block(huffman_context *ctx, const unsigned char *data, size_t data_size, unsigned char *out, size_t capacity);
+size_t decode_block_timed(huffman_context *ctx, const unsigned char *data, size_t data_size, unsigned char *out, size_t capacity, double stage_times[]);
+int check_params(huffman_params *params);
+
+void put_le(unsigned char *out, uint64_t val, int bytes);
+uint64_t get_le(const unsigned char *data, int bytes);
+void write_header(unsigned char *out, archive_info *info);
+int read_header(const unsigned char *data, archive_info *info);
+uint64_t *read_block_offsets(const unsigned char *data, size_t data_size, archive_info *info);
+void print_block_codes(const unsigned char *block, uint32_t index);
+
+double now_seconds(void);
+
+#endif
@@ -1,170 +1,362 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
 #include <getopt.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "huffman.h"
 
 #define DEFAULT_IN "completeShakespeare.txt"
 #define DEFAULT_OUT "huffman.out"
+#define DEFAULT_DECODED "huffman.dec"
+
+#define MAX_THREADS 64
+
+// output is collected and written out in chunks of this size
+#define WRITE_BUFFER_SIZE (1 << 20)
+
+// benchmark (-B) settings: size of every generated corpus, and how many
+// times each corpus is run (the fastest run is reported)
+#define BENCH_SIZE (16 << 20)
+#define BENCH_RUNS 5
+
+struct options {
+    char input_path[128], output_path[128];
+    int decode;
+    size_t block_size;
+    int threads;
+    int verbose;
+    int bench;
+    size_t sync_interval;
+    uint64_t range_offset, range_length;
+    int range;
+    int streams;
+    int method;
+} typedef options;
+
+// a regular input file mapped into memory as a whole
+struct input_view {
+    const unsigned char *data;
+    size_t size;
+} typedef input_view;
+
+// collects output bytes and writes them to `file` in large chunks
+struct output_buffer {
+    FILE *file;
+    unsigned char *data;
+    size_t used;
+} typedef output_buffer;
+
+// state shared by the encoding workers and the main thread, which hands out
+// the input blocks and writes the encoded ones in order. Block `n` goes
+// through slot `n % window`: its input is inputs[slot] (input_sizes[slot]
+// bytes), it is encoded into buffers[slot], and sizes[slot] is 0 until the
+// block is done. The main thread writes a block out before it reuses its
+// slot, so at most `window` blocks are in memory at any time.
+struct encoder {
+    huffman_params params;
+    int window;
+    const unsigned char **inputs;
+    size_t *input_sizes;
+    unsigned char **buffers;
+    size_t *sizes;
+
+    uint32_t published, next_block;
+    int done;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} typedef encoder;
+
+// state shared by the decoding workers, which write every block straight to
+// its place in the output file
+struct decoder {
+    const unsigned char *data;
+    size_t data_size;
+    archive_info info;
+    uint64_t *offsets;
+    int output_fd;
+
+    uint32_t next_block;
+    pthread_mutex_t lock;
+} typedef decoder;
 
-#define ASCII_MAX 128
+FILE *get_file(char path[], char mode[]);
+void get_options(int argc, char **argv, options *opts);
+
+void encode_file(options *opts);
+size_t write_encoded_block(encoder *enc, uint32_t block, output_buffer *output, int verbose);
+void *encode_worker(void *arg);
+
+void decode_file(options *opts);
+void decode_stream(int input_fd, int output_fd, char input_path[]);
+void *decode_worker(void *arg);
+void decode_range_file(options *opts);
+
+int open_input(char path[]);
+int open_output(char path[]);
+int map_view(int fd, input_view *view);
+void close_view(input_view *view);
+size_t read_full(int fd, void *buf, size_t size);
+void write_full(int fd, const void *buf, size_t size);
+void ob_open(output_buffer *ob, char path[]);
+int ob_seekable(output_buffer *ob);
+void ob_write(output_buffer *ob, const void *data, size_t size);
+void ob_flush(output_buffer *ob);
+void ob_close(output_buffer *ob);
+
+void run_bench(options *opts);
+void bench_corpus(const char *name, const unsigned char *data, size_t size, options *opts);
+void generate_corpus(const char *name, unsigned char *data, size_t size);
 
-struct freq_node {
-    unsigned char val;
-    int freq;
-    struct freq_node *prev, *next;
-    struct freq_node *left, *right; 
-} typedef freq_node;
+int main(int argc, char **argv)
+{
+    options opts = { { 0 }, { 0 }, 0, DEFAULT_BLOCK_SIZE, 0, 0, 0, DEFAULT_SYNC_INTERVAL, 0, 0, 0, 1, METHOD_HUFFMAN };
 
-freq_node* pq_create_node(int val);
-freq_node* pq_push(freq_node* head, freq_node* new_node);
-void pq_pop(freq_node** head, freq_node** pop);
+    get_options(argc, argv, &opts);
 
-FILE *get_file(char path[], char mode[]);
-void get_paths(int argc, char **argv, char *input_path, char *output_path);
-void print_bin(unsigned int val, int size);
-void free_memory(freq_node *node);
+    // archives carry their own code tables, so decoding needs nothing else
+    if (opts.bench) {
+        run_bench(&opts);
+    } else if (opts.range) {
+        decode_range_file(&opts);
+    } else if (opts.decode) {
+        decode_file(&opts);
+    } else {
+        encode_file(&opts);
+    }
 
-void generate_huffman_codes(freq_node *root, unsigned int buff, int depth, unsigned int codes[], int code_lengths[]);
+    return 0;
+}
 
+// split the input into blocks, encode them on a pool of worker threads and
+// write them out in order. A mapped input written to a regular file gets a
+// block index; anything else (pipes) is streamed through a fixed number of
+// block buffers, so memory use doesn't depend on the input size.
+void encode_file(options *opts) {
+    int input_fd = open_input(opts->input_path);
+
+    // a mapped input is encoded in place, without any reads
+    input_view input;
+    int mapped = map_view(input_fd, &input);
+
+    output_buffer output;
+    ob_open(&output, opts->output_path);
+
+    int indexed = mapped && ob_seekable(&output);
+
+    encoder enc;
+    enc.params.block_size = opts->block_size;
+    enc.params.sync_interval = opts->sync_interval;
+    enc.params.streams = opts->streams;
+    enc.params.method = opts->method;
+    enc.window = 2 * opts->threads;
+    enc.inputs = malloc(enc.window * sizeof(unsigned char *));
+    enc.input_sizes = malloc(enc.window * sizeof(size_t));
+    enc.buffers = malloc(enc.window * sizeof(unsigned char *));
+    enc.sizes = calloc(enc.window, sizeof(size_t));
+    enc.published = enc.next_block = 0;
+    enc.done = 0;
+
+    // streamed input is read into a buffer per slot
+    unsigned char **read_buffers = calloc(enc.window, sizeof(unsigned char *));
+
+    for (int i = 0; i < enc.window; i++) {
+        enc.buffers[i] = malloc(encode_bound(opts->block_size));
+
+        if (!mapped) read_buffers[i] = malloc(opts->block_size);
+    }
 
-int main(int argc, char **argv)
-{
-    char input_path[128] = { 0 }, output_path[128] = { 0 };
+    pthread_mutex_init(&enc.lock, NULL);
+    pthread_cond_init(&enc.cond, NULL);
 
-    get_paths(argc, argv, input_path, output_path);
+    pthread_t workers[MAX_THREADS];
+    for (int i = 0; i < opts->threads; i++) {
+        pthread_create(&workers[i], NULL, encode_worker, &enc);
+    }
 
-    // frequencies[x] = {val: x, freq: <frequency>}
-    freq_node *frequencies[ASCII_MAX] = { 0 };
+    archive_info info = { FLAG_STREAMED, opts->block_size, 0, 0 };
 
-    for (int i = 0; i < ASCII_MAX; i++) {
-        frequencies[i] = pq_create_node(0);
+    if (indexed) {
+        info.flags = 0;
+        info.size = input.size;
+        info.block_count = (input.size + opts->block_size - 1) / opts->block_size;
     }
 
-    FILE *input = get_file(input_path, "r");
+    unsigned char header[HEADER_SIZE];
+
+    write_header(header, &info);
+    ob_write(&output, header, HEADER_SIZE);
+
+    // the index is only known once all blocks are written, so leave room
+    // for it and fill it in at the end
+    size_t index_size = (size_t)info.block_count * 8;
+    unsigned char *index = calloc(index_size + 1, 1);
 
-    // determine character frequencies
-    char ch;
-    while ((ch = fgetc(input)) != EOF) {
-        if (frequencies[ch]->val == 0) {
-            frequencies[ch]->val = ch; 
+    ob_write(&output, index, index_size);
+
+    uint64_t offset = HEADER_SIZE + index_size, total = 0;
+    uint32_t block = 0, written = 0;
+
+    while (1) {
+        int slot = block % enc.window;
+
+        // the slot's previous block has to be written out before it is reused
+        if (block - written == (uint32_t)enc.window) {
+            if (indexed) put_le(index + (size_t)written * 8, offset, 8);
+
+            offset += write_encoded_block(&enc, written++, &output, opts->verbose);
         }
-        
-        frequencies[ch]->freq++;
-    }
 
-    fclose(input);
+        size_t size;
+
+        if (mapped) {
+            size_t start = (size_t)block * opts->block_size;
+            if (start >= input.size) break;
+
+            size = input.size - start < opts->block_size ? input.size - start : opts->block_size;
+            enc.inputs[slot] = input.data + start;
+        } else {
+            size = read_full(input_fd, read_buffers[slot], opts->block_size);
+            if (size == 0) break;
 
-    // push all frequencies into pq
-    freq_node* pq_head = NULL;
-    for (int i = 0; i < ASCII_MAX; i++) {
-        if (frequencies[i] && frequencies[i]->val != 0) {
-            pq_head = pq_push(pq_head, frequencies[i]);
+            enc.inputs[slot] = read_buffers[slot];
         }
-    }
 
-    // build tree out of pq
-    freq_node *current = pq_head;
-    freq_node *left, *right;
+        enc.input_sizes[slot] = size;
+        total += size;
 
-    while (current->next != NULL) {
-        // pop first two elements
-        pq_pop(&current, &left);
-        pq_pop(&current, &right);
+        // hand the block to the workers
+        pthread_mutex_lock(&enc.lock);
+        enc.published++;
+        pthread_cond_broadcast(&enc.cond);
+        pthread_mutex_unlock(&enc.lock);
 
-        // create internal node
-        freq_node *internal_node = pq_create_node('$');
-        internal_node->freq = left->freq + right->freq;
+        block++;
 
-        // assign children to internal node
-        internal_node->left = left;
-        internal_node->right = right;
-        
-        current = pq_push(current, internal_node);
+        // a short read means the input has ended
+        if (!mapped && size < opts->block_size) break;
     }
 
-    int code_lengths[ASCII_MAX] = {0};
-    unsigned int codes[ASCII_MAX] = {0};
-    unsigned int buff = 0;
-    
-    generate_huffman_codes(current, buff, 0, codes, code_lengths);
+    pthread_mutex_lock(&enc.lock);
+    enc.done = 1;
+    pthread_cond_broadcast(&enc.cond);
+    pthread_mutex_unlock(&enc.lock);
 
-    freq_node *tree_root = current;
+    // write out the blocks still in flight
+    while (written < block) {
+        if (indexed) put_le(index + (size_t)written * 8, offset, 8);
 
-    current = pq_head;
+        offset += write_encoded_block(&enc, written++, &output, opts->verbose);
+    }
 
-    // print codes (debug)
-    printf("%-8s %-8s %-8s %s\n", "ascii", "freq", "codelen", "code");
-    for (int i = 0; i < ASCII_MAX; i++) {
-        if ( (ch = frequencies[i]->val) != 0) {
-            printf("%-8c %-8d %-8u ", ch, frequencies[i]->freq, code_lengths[ch]);
-            print_bin(codes[ch], code_lengths[ch]);
-            printf("\n");
-        }
+    for (int i = 0; i < opts->threads; i++) {
+        pthread_join(workers[i], NULL);
     }
 
-    // encode file
-    input = get_file(input_path, "r");
-    FILE *output = get_file(output_path, "wb");
+    if (indexed) {
+        ob_flush(&output);
+        fseek(output.file, HEADER_SIZE, SEEK_SET);
 
-    unsigned char byte_buffer = 0;
-    unsigned int current_code;
+        if (fwrite(index, 1, index_size, output.file) != index_size) {
+            fprintf(stderr, "Failed to write output\n");
+            exit(1);
+        }
+    } else {
+        unsigned char end_marker[8] = { 0 };
 
-    int buffer_index = 7;
+        ob_write(&output, end_marker, 8);
+        offset += 8;
+    }
 
-    // a flag for keeping track of whether the buffer has been written to the file
-    // this is needed to account for the last byte, which may not be written if it's
-    // not full 
-    int written = 0;
+    ob_close(&output);
 
-    while ((ch = fgetc(input)) != EOF) {
-        written = 0;
+    if (mapped) {
+        close_view(&input);
+    }
 
-        // get current character code
-        current_code = codes[ch];
+    close(input_fd);
 
-        // pack a byte
-        for (int i = 1; i <= code_lengths[ch]; i++) {
-            // write `length - i`th bit to byte at `buffer_index`
-            byte_buffer |= (current_code >> (code_lengths[ch] - i) & 1) << buffer_index;
+    if (opts->verbose) {
+        fprintf(stderr, "%" PRIu64 " bytes -> %" PRIu64 " bytes in %u blocks\n", total, offset, block);
+    }
 
-            // if the buffer is full, write it to the file
-            if (buffer_index == 0) {
-                putc(byte_buffer, output);
+    for (int i = 0; i < enc.window; i++) {
+        free(enc.buffers[i]);
+        free(read_buffers[i]);
+    }
 
-                buffer_index = 7;
-                byte_buffer = 0;
+    free(enc.inputs);
+    free(enc.input_sizes);
+    free(enc.buffers);
+    free(enc.sizes);
+    free(read_buffers);
+    free(index);
 
-                written = 1;
-                continue;
-            }
+    pthread_mutex_destroy(&enc.lock);
+    pthread_cond_destroy(&enc.cond);
+}
 
-            buffer_index--;
-        }
+// wait for `block` to be encoded, write it out and free its slot, returns
+// the number of bytes written
+size_t write_encoded_block(encoder *enc, uint32_t block, output_buffer *output, int verbose) {
+    int slot = block % enc->window;
+
+    pthread_mutex_lock(&enc->lock);
+    while (enc->sizes[slot] == 0) {
+        pthread_cond_wait(&enc->cond, &enc->lock);
     }
+    pthread_mutex_unlock(&enc->lock);
 
-    // if the last byte wasn't full it wasn't written
-    // so, write here
-    if (!written) putc(byte_buffer, output);
+    size_t size = enc->sizes[slot];
 
-    fclose(input);
-    fclose(output);
+    if (verbose) print_block_codes(enc->buffers[slot], block);
 
-    free_memory(tree_root);
+    ob_write(output, enc->buffers[slot], size);
 
-    return 0;
+    // only the main thread touches a finished slot, no lock needed
+    enc->sizes[slot] = 0;
+
+    return size;
 }
 
-// free all tree nodes
-void free_memory(freq_node *node) {
-    if (node == NULL) return;
+// claim published blocks one at a time and encode them until there are
+// none left
+void *encode_worker(void *arg) {
+    encoder *enc = arg;
+    huffman_context *ctx = huffman_create();
 
-    if (node->left == NULL && node->right == NULL) {
-        free(node);
-        return;
+    pthread_mutex_lock(&enc->lock);
+
+    while (1) {
+        if (enc->next_block == enc->published) {
+            if (enc->done) break;
+
+            pthread_cond_wait(&enc->cond, &enc->lock);
+            continue;
+        }
+
+        uint32_t block = enc->next_block++;
+        int slot = block % enc->window;
+
+        pthread_mutex_unlock(&enc->lock);
+
+        size_t encoded_size = encode_block(ctx, enc->inputs[slot], enc->input_sizes[slot], &enc->params, enc->buffers[slot]);
+
+        pthread_mutex_lock(&enc->lock);
+        enc->sizes[slot] = encoded_size;
+        pthread_cond_broadcast(&enc->cond);
     }
 
-    free_memory(node->left);
-    free_memory(node->right);
+    pthread_mutex_unlock(&enc->lock);
+    huffman_free(ctx);
+
+    return NULL;
 }
 
 // help for accessing and validating files, exits on error
@@ -172,136 +364,635 @@ FILE *get_file(char path[], char mode[]) {
     FILE *file = fopen(path, mode);
 
     if (file == NULL) {
-        printf("Failed to open file: %s\n", path);
+        fprintf(stderr, "Failed to open file: %s\n", path);
         exit(1);
     }
 
     return file;
 }
 
-// helper for printing binary values
-void print_bin(unsigned int val, int size) {
-    for (int i = 1; i <= size; i++) {
-        printf("%u", (val >> (size - i)) & 1);
+// decode the archive at `input_path` into `output_path`. A mapped archive
+// decoded into a regular file has its blocks spread over a pool of worker
+// threads; anything else (pipes) is decoded as a stream, one block at a time.
+void decode_file(options *opts) {
+    int input_fd = open_input(opts->input_path);
+    int output_fd = open_output(opts->output_path);
+
+    struct stat st;
+    fstat(output_fd, &st);
+
+    input_view input;
+
+    if (!S_ISREG(st.st_mode) || !map_view(input_fd, &input)) {
+        decode_stream(input_fd, output_fd, opts->input_path);
+
+        close(input_fd);
+        close(output_fd);
+        return;
+    }
+
+    decoder dec;
+    dec.data = input.data;
+    dec.data_size = input.size;
+    dec.output_fd = output_fd;
+    dec.next_block = 0;
+    dec.offsets = NULL;
+
+    if (input.size >= HEADER_SIZE && read_header(input.data, &dec.info)) {
+        dec.offsets = read_block_offsets(input.data, input.size, &dec.info);
     }
+
+    if (dec.offsets == NULL) {
+        fprintf(stderr, "Not a valid archive: %s\n", opts->input_path);
+        exit(1);
+    }
+
+    pthread_mutex_init(&dec.lock, NULL);
+
+    pthread_t workers[MAX_THREADS];
+    for (int i = 0; i < opts->threads; i++) {
+        pthread_create(&workers[i], NULL, decode_worker, &dec);
+    }
+
+    for (int i = 0; i < opts->threads; i++) {
+        pthread_join(workers[i], NULL);
+    }
+
+    pthread_mutex_destroy(&dec.lock);
+
+    free(dec.offsets);
+    close_view(&input);
+    close(input_fd);
+    close(output_fd);
 }
 
-// traverse the tree to generate a code for each character
-void generate_huffman_codes(freq_node *root, unsigned int buff, int depth, unsigned int codes[], int code_lengths[]) {
-    if (root == NULL || root->val == 0) return;
+// decode an archive read sequentially from `input_fd`, holding only one
+// block (and its encoded form) in memory at a time
+void decode_stream(int input_fd, int output_fd, char input_path[]) {
+    unsigned char header[HEADER_SIZE];
+    archive_info info;
 
-    // if a leaf node is reached, save the code and its length
-    if (root->left == NULL && root->right == NULL) {
-        codes[root->val] = buff;
-        code_lengths[root->val] = depth;
+    if (read_full(input_fd, header, HEADER_SIZE) != HEADER_SIZE || !read_header(header, &info)) {
+        fprintf(stderr, "Not a valid archive: %s\n", input_path);
+        exit(1);
+    }
 
-        return;
+    size_t capacity = encode_bound(info.block_size);
+    unsigned char *block = malloc(capacity);
+    unsigned char *out = malloc(info.block_size);
+    huffman_context *ctx = huffman_create();
+
+    // the blocks of an indexed archive follow the index in order
+    for (uint64_t left = (uint64_t)info.block_count * 8; left > 0; ) {
+        size_t n = left < capacity ? left : capacity;
+
+        if (read_full(input_fd, block, n) != n) {
+            fprintf(stderr, "Corrupt input: truncated index\n");
+            exit(1);
+        }
+
+        left -= n;
     }
 
-    depth++;
+    for (uint32_t n = 0; (info.flags & FLAG_STREAMED) || n < info.block_count; n++) {
+        if (read_full(input_fd, block, 8) != 8) {
+            fprintf(stderr, "Corrupt input: truncated archive\n");
+            exit(1);
+        }
+
+        size_t size = get_le(block, 4);
+        size_t payload_size = get_le(block + 4, 4);
 
-    // left = 1, right = 0
-    generate_huffman_codes(root->left, (buff << 1) | 1,  depth, codes, code_lengths);
-    generate_huffman_codes(root->right, (buff << 1),  depth, codes, code_lengths);
+        if (size == 0 && (info.flags & FLAG_STREAMED)) break;
+
+        size_t rest = BLOCK_HEADER_SIZE - 8 + payload_size;
+
+        if (size == 0 || size > info.block_size || rest > capacity - 8 || read_full(input_fd, block + 8, rest) != rest) {
+            fprintf(stderr, "Corrupt input: invalid block %u\n", n);
+            exit(1);
+        }
+
+        if (decode_block(ctx, block, rest + 8, out, info.block_size) != size) {
+            fprintf(stderr, "Corrupt input: invalid block %u\n", n);
+            exit(1);
+        }
+
+        write_full(output_fd, out, size);
+    }
+
+    free(block);
+    free(out);
+    huffman_free(ctx);
 }
 
-// helper function for allocating and initializing a new node
-freq_node* pq_create_node(int val) {
-    freq_node* new_node = malloc(sizeof(freq_node));
+// claim blocks one at a time, decode them and write them to their place in
+// the output file until none are left
+void *decode_worker(void *arg) {
+    decoder *dec = arg;
+    huffman_context *ctx = huffman_create();
+    unsigned char *out = malloc(dec->info.block_size);
+
+    while (1) {
+        pthread_mutex_lock(&dec->lock);
+        uint32_t block = dec->next_block++;
+        pthread_mutex_unlock(&dec->lock);
+
+        if (block >= dec->info.block_count) break;
+
+        uint64_t offset = dec->offsets[block];
+        uint64_t start = (uint64_t)block * dec->info.block_size;
+        size_t expected = dec->info.size - start < dec->info.block_size ? dec->info.size - start : dec->info.block_size;
+        size_t size = decode_block(ctx, dec->data + offset, dec->data_size - offset, out, dec->info.block_size);
+
+        if (size != expected || size == 0) {
+            fprintf(stderr, "Corrupt input: invalid block %u\n", block);
+            exit(1);
+        }
+
+        if (pwrite(dec->output_fd, out, size, start) != (ssize_t)size) {
+            fprintf(stderr, "Failed to write output\n");
+            exit(1);
+        }
+    }
 
-    new_node->val = val;
-    new_node->freq = 0;
-    new_node->prev = new_node->next = NULL;
-    new_node->left = new_node->right = NULL;
+    huffman_free(ctx);
+    free(out);
 
-    return new_node;
+    return NULL;
 }
 
-// pops out the first (minimum) node, saving it to `pop`
-void pq_pop(freq_node** head, freq_node** pop) {
-    *pop = *head;
+// decode the byte range given with -r from a mapped archive into the output
+// file, without decoding anything outside the sync intervals it touches
+void decode_range_file(options *opts) {
+    int input_fd = open_input(opts->input_path);
+    input_view input;
+
+    if (!map_view(input_fd, &input)) {
+        fprintf(stderr, "Range decoding needs a regular input file: %s\n", opts->input_path);
+        exit(1);
+    }
 
-    *head = (*head)->next;
+    double start = now_seconds();
 
-    if ((*head) != NULL) {
+    uint64_t size;
 
-        (*head)->prev = NULL;
+    if (!huffman_decompressed_size(input.data, input.size, &size)) {
+        fprintf(stderr, "Not a valid archive: %s\n", opts->input_path);
+        exit(1);
     }
 
-    (*pop)->next = NULL;
+    // clamp the range to the end of the data
+    uint64_t offset = opts->range_offset < size ? opts->range_offset : size;
+    size_t length = size - offset < opts->range_length ? size - offset : opts->range_length;
+
+    unsigned char *out = malloc(length + 1);
+    huffman_context *ctx = huffman_create();
+
+    if (!huffman_decompress_range(ctx, input.data, input.size, offset, length, out)) {
+        fprintf(stderr, "Corrupt input: invalid block\n");
+        exit(1);
+    }
+
+    if (opts->verbose) {
+        fprintf(stderr, "%zu bytes at %" PRIu64 " in %.3f ms\n", length, offset, (now_seconds() - start) * 1e3);
+    }
+
+    output_buffer output;
+    ob_open(&output, opts->output_path);
+    ob_write(&output, out, length);
+    ob_close(&output);
+
+    free(out);
+    huffman_free(ctx);
+    close_view(&input);
+    close(input_fd);
 }
 
-// insert `new_node` at the correct position based on frequency
-freq_node* pq_push(freq_node* head, freq_node* new_node) {
-    freq_node* current_node = head;
-
-    // if the pq is empty, set head to `new_node`
-    if (current_node == NULL) {
-        return new_node;
-    // if `new_node` should be inserted before the current head
-    } else if (new_node->freq < current_node->freq) {
-        new_node->next = current_node;
-        new_node->prev = NULL;
-        
-        current_node->prev = new_node;
-
-        return new_node;
-    } else {
-        // iterating up to the insertion point
-        while (current_node->next != NULL && current_node->next->freq < new_node->freq) {
-            current_node = current_node->next;
+// benchmark the codec on every generated corpus, or on the input file if
+// one is given, and print one JSON object per corpus to stdout. Blocks are
+// encoded and decoded in memory on this thread only, so the numbers measure
+// the codec itself rather than I/O or the thread pool.
+void run_bench(options *opts) {
+    if (opts->input_path[0] != 0) {
+        int fd = open_input(opts->input_path);
+        input_view input;
+
+        if (!map_view(fd, &input)) {
+            fprintf(stderr, "Benchmark input must be a regular file: %s\n", opts->input_path);
+            exit(1);
         }
 
-        // if `new_node` is to be inserted at the end of the pq
-        if (current_node== NULL) {
-            current_node->next = new_node;
-            new_node->prev = current_node;
-            new_node->next = NULL;
-        } else {
-            new_node->prev = current_node;
-            new_node->next = current_node->next;
+        bench_corpus(opts->input_path, input.data, input.size, opts);
+
+        close_view(&input);
+        close(fd);
+        return;
+    }
+
+    const char *corpora[] = { "english", "skewed", "uniform", "one-symbol" };
+    unsigned char *data = malloc(BENCH_SIZE);
+
+    for (int i = 0; i < 4; i++) {
+        generate_corpus(corpora[i], data, BENCH_SIZE);
+        bench_corpus(corpora[i], data, BENCH_SIZE, opts);
+    }
 
-            current_node->next = new_node;
+    free(data);
+}
+
+// encode and decode `data` BENCH_RUNS times, check the round trip and print
+// the fastest run
+void bench_corpus(const char *name, const unsigned char *data, size_t size, options *opts) {
+    size_t block_size = opts->block_size;
+    huffman_params params = { block_size, opts->sync_interval, opts->streams, opts->method };
+    size_t block_count = (size + block_size - 1) / block_size;
+    unsigned char *encoded = malloc(block_count * encode_bound(block_size) + 1);
+    unsigned char *decoded = malloc(size + 1);
+    size_t *offsets = malloc((block_count + 1) * sizeof(size_t));
+    huffman_context *ctx = huffman_create();
+
+    double best[STAGE_COUNT] = { 0 };
+    double best_encode = 0, best_decode = 0;
+    size_t encoded_size = 0;
+
+    for (int run = 0; run < BENCH_RUNS; run++) {
+        double stage_times[STAGE_COUNT] = { 0 };
+        double start = now_seconds();
 
-            if (new_node->next != NULL) {
-                new_node->next->prev = new_node;
+        encoded_size = 0;
+
+        for (size_t b = 0; b < block_count; b++) {
+            size_t n = size - b * block_size < block_size ? size - b * block_size : block_size;
+
+            offsets[b] = encoded_size;
+            encoded_size += encode_block_timed(ctx, data + b * block_size, n, &params, encoded + encoded_size, stage_times);
+        }
+
+        double encode_time = now_seconds() - start;
+
+        start = now_seconds();
+
+        for (size_t b = 0; b < block_count; b++) {
+            size_t n = size - b * block_size < block_size ? size - b * block_size : block_size;
+
+            if (decode_block_timed(ctx, encoded + offsets[b], encoded_size - offsets[b], decoded + b * block_size, n, stage_times) != n) {
+                fprintf(stderr, "Benchmark failed: block %zu of %s doesn't decode\n", b, name);
+                exit(1);
             }
         }
+
+        double decode_time = now_seconds() - start;
+
+        if (memcmp(data, decoded, size) != 0) {
+            fprintf(stderr, "Benchmark failed: %s doesn't round trip\n", name);
+            exit(1);
+        }
+
+        if (run == 0 || encode_time + decode_time < best_encode + best_decode) {
+            best_encode = encode_time;
+            best_decode = decode_time;
+            memcpy(best, stage_times, sizeof(best));
+        }
+    }
+
+    double mb = size / 1e6;
+    const char *method_names[] = { "huffman", "tans", "lz" };
+
+    printf("{\"corpus\": \"%s\", \"method\": \"%s\", \"streams\": %d, \"bytes\": %zu, \"encoded_bytes\": %zu, \"ratio\": %.4f, "
+           "\"encode_mbps\": %.1f, \"decode_mbps\": %.1f, "
+           "\"histogram_s\": %.6f, \"tree_s\": %.6f, \"codegen_s\": %.6f, \"encode_s\": %.6f, "
+           "\"match_s\": %.6f, \"decode_table_s\": %.6f, \"decode_s\": %.6f}\n",
+           name, method_names[opts->method], opts->streams, size, encoded_size, size ? (double)encoded_size / size : 0,
+           best_encode > 0 ? mb / best_encode : 0, best_decode > 0 ? mb / best_decode : 0,
+           best[STAGE_HISTOGRAM], best[STAGE_TREE], best[STAGE_CODEGEN], best[STAGE_ENCODE],
+           best[STAGE_MATCH], best[STAGE_DECODE_TABLE], best[STAGE_DECODE]);
+    fflush(stdout);
+
+    free(encoded);
+    free(decoded);
+    free(offsets);
+    huffman_free(ctx);
+}
+
+// fill `data` with a deterministic test corpus:
+//   english:    words drawn from a small vocabulary with Zipf-like weights
+//   skewed:     byte k (below 64) with probability about 2^-(k+1)
+//   uniform:    uniformly random bytes
+//   one-symbol: a single repeated byte
+void generate_corpus(const char *name, unsigned char *data, size_t size) {
+    static const char *words[] = {
+        "the", "and", "to", "of", "I", "you", "a", "my", "in", "that", "is", "not",
+        "with", "me", "it", "for", "be", "his", "your", "this", "but", "he", "have",
+        "as", "thou", "so", "him", "will", "what", "thy", "all", "her", "no", "do",
+        "by", "shall", "if", "are", "we", "thee", "our", "lord", "on", "king", "good",
+        "now", "sir", "from", "come", "they", "love", "enter", "would", "more", "was",
+        "well", "let", "here", "there", "heaven", "make", "speak", "night", "death"
+    };
+    uint64_t state = 0x9e3779b97f4a7c15ULL;
+    size_t i = 0;
+
+    while (i < size) {
+        // xorshift64
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+
+        if (strcmp(name, "english") == 0) {
+            // cubing a uniform value in [0, 1) favours the first words
+            double r = (state >> 11) * (1.0 / 9007199254740992.0);
+            const char *word = words[(int)(64 * r * r * r)];
+
+            for (int k = 0; word[k] != 0 && i < size; k++) {
+                data[i++] = word[k];
+            }
+
+            if (i < size) {
+                data[i++] = (state & 0xf) == 0 ? '\n' : (state & 0xf) == 1 ? ',' : ' ';
+            }
+        } else if (strcmp(name, "skewed") == 0) {
+            int k = 0;
+
+            while (k < 63 && (state >> k & 1)) k++;
+
+            data[i++] = k;
+        } else if (strcmp(name, "uniform") == 0) {
+            for (int k = 0; k < 8 && i < size; k++) {
+                data[i++] = state >> (8 * k);
+            }
+        } else {
+            memset(data, 'a', size);
+            i = size;
+        }
+    }
+}
+
+// open the input file, "-" is stdin; exits on error
+int open_input(char path[]) {
+    if (strcmp(path, "-") == 0) return STDIN_FILENO;
+
+    int fd = open(path, O_RDONLY);
+
+    if (fd < 0) {
+        fprintf(stderr, "Failed to open file: %s\n", path);
+        exit(1);
+    }
+
+    return fd;
+}
+
+// create (or truncate) the output file, "-" is stdout; exits on error
+int open_output(char path[]) {
+    if (strcmp(path, "-") == 0) return STDOUT_FILENO;
+
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+    if (fd < 0) {
+        fprintf(stderr, "Failed to open file: %s\n", path);
+        exit(1);
+    }
+
+    return fd;
+}
+
+// map the whole file behind `fd` into memory, returns 0 if it isn't a
+// regular file (or can't be mapped) and has to be read as a stream
+int map_view(int fd, input_view *view) {
+    struct stat st;
+
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) return 0;
+
+    view->data = NULL;
+    view->size = st.st_size;
+
+    // an empty file can't be mapped, but there is nothing to read either
+    if (view->size == 0) return 1;
+
+    void *map = mmap(NULL, view->size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+    if (map == MAP_FAILED) return 0;
+
+    madvise(map, view->size, MADV_SEQUENTIAL);
+    view->data = map;
+
+    return 1;
+}
+
+void close_view(input_view *view) {
+    if (view->size > 0) {
+        munmap((void *)view->data, view->size);
+    }
+}
+
+// read until `size` bytes are in or the input ends, returns the number of
+// bytes read; exits on error
+size_t read_full(int fd, void *buf, size_t size) {
+    size_t done = 0;
+
+    while (done < size) {
+        ssize_t n = read(fd, (unsigned char *)buf + done, size - done);
+
+        if (n < 0) {
+            fprintf(stderr, "Failed to read input\n");
+            exit(1);
+        }
+        if (n == 0) break;
+
+        done += n;
+    }
+
+    return done;
+}
+
+// write all of `buf`; exits on error
+void write_full(int fd, const void *buf, size_t size) {
+    while (size > 0) {
+        ssize_t n = write(fd, buf, size);
+
+        if (n <= 0) {
+            fprintf(stderr, "Failed to write output\n");
+            exit(1);
+        }
+
+        buf = (const unsigned char *)buf + n;
+        size -= n;
     }
+}
 
-    return head;
+// open the output file, "-" is stdout
+void ob_open(output_buffer *ob, char path[]) {
+    ob->file = strcmp(path, "-") == 0 ? stdout : get_file(path, "wb");
+    ob->data = malloc(WRITE_BUFFER_SIZE);
+    ob->used = 0;
+}
+
+// append `size` bytes to the buffer, writing it out whenever it fills up
+void ob_write(output_buffer *ob, const void *data, size_t size) {
+    const unsigned char *bytes = data;
+
+    // large writes skip the copy into the buffer
+    if (size >= WRITE_BUFFER_SIZE) {
+        ob_flush(ob);
+
+        if (fwrite(bytes, 1, size, ob->file) != size) {
+            fprintf(stderr, "Failed to write output\n");
+            exit(1);
+        }
+
+        return;
+    }
+
+    while (size > 0) {
+        size_t n = WRITE_BUFFER_SIZE - ob->used;
+        if (n > size) n = size;
+
+        memcpy(ob->data + ob->used, bytes, n);
+        ob->used += n;
+        bytes += n;
+        size -= n;
+
+        if (ob->used == WRITE_BUFFER_SIZE) ob_flush(ob);
+    }
+}
+
+// only a regular file can have its block index filled in afterwards
+int ob_seekable(output_buffer *ob) {
+    struct stat st;
+
+    return fstat(fileno(ob->file), &st) == 0 && S_ISREG(st.st_mode);
+}
+
+void ob_flush(output_buffer *ob) {
+    if (ob->used > 0 && fwrite(ob->data, 1, ob->used, ob->file) != ob->used) {
+        fprintf(stderr, "Failed to write output\n");
+        exit(1);
+    }
+
+    ob->used = 0;
+}
+
+void ob_close(output_buffer *ob) {
+    ob_flush(ob);
+    fclose(ob->file);
+    free(ob->data);
 }
 
 // process the command line options (or fall back to default values):
-//      -i <path>: input path 
-//      -o <path>: output path 
-void get_paths(int argc, char **argv, char *input_path, char *output_path) {
+//      -i <path>: input path ("-" for stdin)
+//      -o <path>: output path ("-" for stdout)
+//      -d: decode the input instead of encoding it
+//      -b <KB>: block size (encoding)
+//      -j <n>: number of worker threads (default: one per CPU)
+//      -v: print the code table of every block (to stderr)
+//      -s <KB>: sync point interval (encoding, default 64, 0 for none)
+//      -n <1|4>: number of interleaved bitstreams per block (encoding)
+//      -e <huffman|tans|lz>: entropy coder (encoding, default huffman); lz
+//          finds LZ77 matches first and Huffman codes the literals and
+//          matches, for input with repeated strings such as logs
+//      -r <offset>,<length>: decode only this byte range of the original
+//          data (needs a regular archive file)
+//      -B: benchmark the codec on generated corpora (or on the input file,
+//          if given) and print the results as JSON lines
+void get_options(int argc, char **argv, options *opts) {
     int opt;
 
     // check if input/output paths are given
-    while ((opt = getopt(argc, argv, "i:o:")) != -1) {
+    while ((opt = getopt(argc, argv, "i:o:db:j:vBs:r:n:e:")) != -1) {
 
         switch (opt) {
             case 'i':
-                strcpy(input_path, optarg);
+                strcpy(opts->input_path, optarg);
                 break;
 
             case 'o':
-                strcpy(output_path, optarg);
+                strcpy(opts->output_path, optarg);
+                break;
+
+            case 'd':
+                opts->decode = 1;
+                break;
+
+            case 'b':
+                opts->block_size = (size_t)atoi(optarg) * 1024;
+                break;
+
+            case 'j':
+                opts->threads = atoi(optarg);
+                break;
+
+            case 'v':
+                opts->verbose = 1;
+                break;
+
+            case 'B':
+                opts->bench = 1;
+                break;
+
+            case 's':
+                opts->sync_interval = (size_t)atoi(optarg) * 1024;
+                break;
+
+            case 'n':
+                opts->streams = atoi(optarg);
+                break;
+
+            case 'e':
+                if (strcmp(optarg, "huffman") == 0) {
+                    opts->method = METHOD_HUFFMAN;
+                } else if (strcmp(optarg, "tans") == 0) {
+                    opts->method = METHOD_TANS;
+                } else if (strcmp(optarg, "lz") == 0) {
+                    opts->method = METHOD_LZ;
+                } else {
+                    fprintf(stderr, "Unknown entropy coder: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+
+            case 'r':
+                if (sscanf(optarg, "%" SCNu64 ",%" SCNu64, &opts->range_offset, &opts->range_length) != 2) {
+                    fprintf(stderr, "Range must be given as <offset>,<length>\n");
+                    exit(1);
+                }
+
+                opts->range = 1;
+                opts->decode = 1;
                 break;
 
             default:
-                printf("Usage: %s [-i input] [-o output]\n", argv[0]);
+                fprintf(stderr, "Usage: %s [-i input] [-o output] [-d] [-b block KB] [-j threads] [-v] [-B] [-s sync KB] [-n streams] [-e huffman|tans|lz] [-r offset,length]\n", argv[0]);
                 exit(1);
         }
 
     }
 
-    // use default values if no input
-    if (input_path[0] == 0) {
-        strcpy(input_path, DEFAULT_IN);
+    if (opts->block_size == 0 || opts->block_size > MAX_BLOCK_SIZE) {
+        fprintf(stderr, "Block size must be between 1 and %d KB\n", MAX_BLOCK_SIZE / 1024);
+        exit(1);
+    }
+
+    if (opts->streams != 1 && opts->streams != MAX_STREAMS) {
+        fprintf(stderr, "Stream count must be 1 or %d\n", MAX_STREAMS);
+        exit(1);
+    }
+
+    if (opts->streams != 1 && opts->method != METHOD_HUFFMAN) {
+        fprintf(stderr, "%s blocks are a single stream\n", opts->method == METHOD_TANS ? "tANS" : "LZ");
+        exit(1);
+    }
+
+    if (opts->threads <= 0) {
+        opts->threads = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (opts->threads > MAX_THREADS) {
+        opts->threads = MAX_THREADS;
+    }
+
+    // use default values if no input; the benchmark uses generated corpora
+    // instead
+    if (opts->input_path[0] == 0 && !opts->bench) {
+        strcpy(opts->input_path, opts->decode ? DEFAULT_OUT : DEFAULT_IN);
     }
-    if (output_path[0] == 0) {
-        strcpy(output_path, DEFAULT_OUT);
+    if (opts->output_path[0] == 0) {
+        strcpy(opts->output_path, opts->decode ? DEFAULT_DECODED : DEFAULT_OUT);
     }
 }
@@ -0,0 +1,215 @@
+/*
+huffman_test.c: checks of the codec library (huffman.c) that the command line
+round trips don't cover. Built by `make test` with malloc, calloc and realloc
+wrapped (-Wl,--wrap), so the allocations a call makes can be counted.
+
+Usage:
+    ./huffman_test (prints the failed checks, exits with 1 if there are any)
+*/
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "huffman.h"
+
+// allocations made through the wrappers so far
+size_t allocations;
+int failures;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t count, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+void check(int ok, const char *what, huffman_params *params);
+void fill_corpus(unsigned char *data, size_t size);
+int round_trip(huffman_context *ctx, huffman_params *params, const unsigned char *data, size_t size);
+
+void test_sync_intervals(huffman_context *ctx, const unsigned char *data, size_t size);
+void test_warm_allocations(huffman_context *ctx, const unsigned char *data, size_t size);
+void test_empty_blocks(huffman_context *ctx, const unsigned char *data);
+
+void *__wrap_malloc(size_t size) {
+    allocations++;
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t count, size_t size) {
+    allocations++;
+    return __real_calloc(count, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size) {
+    allocations++;
+    return __real_realloc(ptr, size);
+}
+
+int main(void) {
+    size_t size = 3 << 20;
+    unsigned char *data = malloc(size);
+    huffman_context *ctx = huffman_create();
+
+    fill_corpus(data, size);
+
+    test_sync_intervals(ctx, data, size);
+    test_warm_allocations(ctx, data, size);
+    test_empty_blocks(ctx, data);
+
+    huffman_free(ctx);
+    free(data);
+
+    if (failures > 0) {
+        printf("%d checks failed\n", failures);
+        return 1;
+    }
+
+    printf("all checks passed\n");
+
+    return 0;
+}
+
+// sync intervals that aren't whole KB can't start every sync point on
+// stream 0 and are refused; whole KB ones round trip with 1 and 4 streams
+void test_sync_intervals(huffman_context *ctx, const unsigned char *data, size_t size) {
+    size_t unaligned[] = { 1, 1023, 1025, 1026, 1027, 1536 + 2, 65537 };
+    size_t aligned[] = { 0, 1024, 2048, 5 << 10, 64 << 10 };
+    huffman_params params;
+
+    huffman_default_params(&params);
+    params.block_size = 1 << 20;
+
+    for (int streams = 1; streams <= MAX_STREAMS; streams += MAX_STREAMS - 1) {
+        params.streams = streams;
+
+        for (size_t i = 0; i < sizeof(unaligned) / sizeof(unaligned[0]); i++) {
+            params.sync_interval = unaligned[i];
+            check(!check_params(&params), "unaligned sync interval refused", &params);
+            check(huffman_compress_bound(size, &params) == 0, "no bound for an unaligned sync interval", &params);
+            check(round_trip(ctx, &params, data, size) < 0, "unaligned sync interval not compressed", &params);
+        }
+
+        for (size_t i = 0; i < sizeof(aligned) / sizeof(aligned[0]); i++) {
+            params.sync_interval = aligned[i];
+            check(round_trip(ctx, &params, data, size) == 1, "round trip", &params);
+        }
+    }
+
+    params.streams = 1;
+    params.sync_interval = 0;
+    params.block_size = 0;
+    check(huffman_compress_bound(size, &params) == 0, "no bound for an empty block size", &params);
+}
+
+// once a context has seen a few calls, compressing and decompressing with
+// it allocates nothing
+void test_warm_allocations(huffman_context *ctx, const unsigned char *data, size_t size) {
+    int methods[] = { METHOD_HUFFMAN, METHOD_HUFFMAN, METHOD_TANS, METHOD_LZ };
+    int streams[] = { 1, MAX_STREAMS, 1, 1 };
+    huffman_params params;
+
+    huffman_default_params(&params);
+
+    for (int i = 0; i < 4; i++) {
+        params.method = methods[i];
+        params.streams = streams[i];
+
+        size_t capacity = huffman_compress_bound(size, &params);
+        unsigned char *archive = malloc(capacity), *output = malloc(size);
+        size_t archive_size = 0, output_size;
+
+        // warm up
+        for (int k = 0; k < 2; k++) {
+            archive_size = huffman_compress(ctx, &params, data, size, archive, capacity);
+            huffman_decompress(ctx, archive, archive_size, output, size, &output_size);
+            huffman_decompress_range(ctx, archive, archive_size, size / 3, 4096, output);
+        }
+
+        allocations = 0;
+        huffman_compress(ctx, &params, data, size, archive, capacity);
+        check(allocations == 0, "no allocations when compressing on a warm context", &params);
+
+        allocations = 0;
+        huffman_decompress(ctx, archive, archive_size, output, size, &output_size);
+        check(allocations == 0, "no allocations when decompressing on a warm context", &params);
+
+        allocations = 0;
+        huffman_decompress_range(ctx, archive, archive_size, size / 3, 4096, output);
+        check(allocations == 0, "no allocations when decompressing a range on a warm context", &params);
+
+        free(archive);
+        free(output);
+    }
+}
+
+// a block that claims to be empty is corrupt, whatever its method; a tANS
+// one with no counts used to have its decode table built anyway
+void test_empty_blocks(huffman_context *ctx, const unsigned char *data) {
+    int methods[] = { METHOD_HUFFMAN, METHOD_TANS, METHOD_LZ };
+    size_t size = 4096;
+    huffman_params params;
+
+    huffman_default_params(&params);
+
+    for (int i = 0; i < 3; i++) {
+        params.method = methods[i];
+
+        unsigned char *block = malloc(huffman_compress_bound(size, &params)), output[4096];
+        size_t block_size = encode_block(ctx, data, size, &params, block);
+
+        check(block_size > 0 && decode_block(ctx, block, block_size, output, size) == size, "block round trip", &params);
+
+        // no size and, for tANS, no counts
+        memset(block, 0, 4);
+        if (params.method == METHOD_TANS) memset(block + BLOCK_HEADER_SIZE, 0, 2 * 256);
+
+        check(decode_block(ctx, block, block_size, output, size) == 0, "empty block refused", &params);
+
+        free(block);
+    }
+}
+
+// compress and decompress `data` (all of it, then a range across a block
+// boundary). Returns 1 if it comes back the same, 0 if not, -1 if it
+// couldn't be compressed.
+int round_trip(huffman_context *ctx, huffman_params *params, const unsigned char *data, size_t size) {
+    size_t capacity = huffman_compress_bound(size, params);
+    unsigned char *archive = malloc(capacity), *output = malloc(size);
+    size_t archive_size = huffman_compress(ctx, params, data, size, archive, capacity), output_size = 0;
+    size_t offset = params->block_size - 3000, length = 7000;
+    int result = -1;
+
+    if (archive_size > 0) {
+        result = huffman_decompress(ctx, archive, archive_size, output, size, &output_size) &&
+                 output_size == size && memcmp(output, data, size) == 0 &&
+                 huffman_decompress_range(ctx, archive, archive_size, offset, length, output) &&
+                 memcmp(output, data + offset, length) == 0;
+    }
+
+    free(archive);
+    free(output);
+
+    return result;
+}
+
+// some text-like data: words of a small vocabulary with runs and noise
+void fill_corpus(unsigned char *data, size_t size) {
+    const char *words[] = { "the ", "stripe ", "parity ", "of ", "a ", "block\n", "codeword ", "and " };
+    uint32_t x = 12345;
+
+    for (size_t i = 0; i < size; ) {
+        x = x * 1103515245 + 12345;
+
+        const char *word = words[(x >> 16) % 8];
+
+        for (size_t k = 0; word[k] && i < size; k++) {
+            data[i++] = (x >> 28) == 0 ? (unsigned char)(x >> 8) : word[k];
+        }
+    }
+}
+
+void check(int ok, const char *what, huffman_params *params) {
+    if (ok) return;
+
+    printf("FAILED: %s (method %d, %d streams, sync interval %zu)\n", what, params->method, params->streams, params->sync_interval);
+    failures++;
+}
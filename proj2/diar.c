@@ -1,133 +1,833 @@
 /*
 diar.c: decode an array of 7 files (emulating RAID 2) using Hamming(7, 4).
+The parity checks are bit-sliced: 64 codewords are checked and corrected at once.
+Wider codes (see raid.c) are checked the same way, then untangled with a 64x64
+transpose. One missing part file can be done without (degraded mode), and -R
+rebuilds a lost part file from the others. With -j, chunks are decoded by several
+threads, each reading and writing at its own offsets. Block-striped RAID 5/6 part
+files (-l 5 or 6) can do without one or two part files.
+The size, code and layout default to the ones in filename.manifest (see raid.c).
+Its CRCs let clean blocks skip the parity checks: every block is decoded as is
+first, and only decoded again with correction if it doesn't match its CRC.
+With -o and -L, only a byte range of the file is decoded, from the words of the
+part files that hold it.
 
 Usage:
-    ./diar -f filename (default: test.txt) -s size
+    ./diar -f filename (default: test.txt) [-s size] [-c code (default: 7,4)] [-j threads] [-D (direct I/O)]
+    ./diar -f filename [-s size] [-c code] -o offset [-L length (default: to the end)]
+    ./diar -f filename [-s size] -l 5|6 [-n data parts (default: 4)] [-b block size (default: 65536)] [-D]
+    ./diar -f filename -R part [-c code | -l 5|6 -n parts -b bytes] [-D]
 */
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <endian.h>
 #include <getopt.h>
+#include <pthread.h>
+
+#include "raid2.h"
+#include "raid56.h"
 
 #define DEFAULT_IN "test.txt"
 
-void init_raid2(FILE *raid2[7], char basename[128]);
+// number of bytes read from every part file at a time for Hamming(7,4)
+// (other codes scale it to about the same amount of output). Chunks are a
+// multiple of IO_ALIGN, and of 8 so the parity checks always work on whole
+// 64-bit words.
+#define CHUNK_SIZE (1 << 20)
+#define DEFAULT_CODE "7,4"
+#define DEFAULT_DATA 4
+#define DEFAULT_BLOCK 65536
+
+// what decoding found: codewords with more errors than could be corrected
+// (where the code can tell), and blocks that don't match their CRC even so
+struct decode_report {
+    uint64_t failed;
+    uint64_t mismatched;
+} typedef decode_report;
+
+// the state shared by the threads of a parallel decoding: chunk k of the
+// stripes, from byte k * chunk on, decodes to output from data * k * chunk
+// on
+struct decoder {
+    hamming_code *code;
+    const uint32_t *crcs;
+    int fds[MAX_PARTS];
+    int missing;
+    int output;
+    uint64_t output_size, stripe_size;
+    size_t chunk;
+
+    pthread_mutex_t lock;
+    uint64_t next_chunk;
+    decode_report report;
+} typedef decoder;
+
 unsigned char encode_nibble(unsigned char nibble); 
 
-void get_args(int argc, char **argv, char *input_path, int *size);
+void decode_chunk(hamming_code *code, unsigned char *stripes[], size_t got[], size_t size, unsigned char *output, size_t output_bytes, int missing, const uint32_t *crcs, decode_report *report);
+void decode_words(hamming_code *code, unsigned char *stripes[], size_t size, unsigned char *output, int missing, int correct, uint64_t *failed);
+uint64_t decode_stripes(hamming_code *code, unsigned char *stripes[7], size_t size, unsigned char *output, int missing, int correct);
+uint64_t correct_words(uint64_t words[7]);
+void unstripe(unsigned char *data[4], size_t index, unsigned char *output);
+
+uint64_t decode_code(hamming_code *code, unsigned char *stripes[], size_t size, unsigned char *output, int missing, int correct, uint64_t *failed);
+
+decode_report decode_parallel(char input_path[], char output_path[], hamming_code *code, const uint32_t *crcs, uint64_t output_size, size_t chunk, int threads);
+void *decode_worker(void *arg);
+
+void decode_range(char input_path[], char output_path[], hamming_code *code, uint64_t output_size, uint64_t offset, uint64_t length);
+
+void rebuild_part(char input_path[], hamming_code *code, size_t chunk, int part, int direct);
+
+void decode_blocks(char input_path[], block_layout *layout, uint64_t output_size, int rebuild, int direct);
+void check_lost(part_set *set, char input_path[], int spare);
+void report_failed(decode_report *report);
+
+void use_manifest(manifest *m, uint64_t *size, char *code_name, int *level, int *data, size_t *block);
+
+void get_args(int argc, char **argv, char *input_path, uint64_t *size, char *code_name, int *level, int *data, size_t *block, int *threads, int *rebuild, int *direct, uint64_t *offset, uint64_t *length);
 FILE *get_file(char path[], char mode[]);
 
 int main(int argc, char **argv) {
-    char input_path[128] = { 0 }, output_path[256] = { 0 };
-    int output_size = 0;
-    FILE *output, *raid2[7];
+    char input_path[128] = { 0 }, output_path[256] = { 0 }, code_name[32] = { 0 };
+    uint64_t output_size = UINT64_MAX, offset = 0, length = UINT64_MAX;
+    int level = 0, data = 0, threads = 1, rebuild = -1, direct = 0;
+    size_t block = 0;
+    FILE *output;
+    hamming_code code;
+    part_set raid2;
+    manifest m = { 0 };
+    decode_report report = { 0 };
 
     /* setup */
 
-    get_args(argc, argv, input_path, &output_size);
+    get_args(argc, argv, input_path, &output_size, code_name, &level, &data, &block, &threads, &rebuild, &direct, &offset, &length);
+
+    // the threads share their file descriptors, which can't switch to the
+    // page cache for the unaligned end of a part file one thread at a time
+    if (threads > 1 && direct) {
+        printf("-j and -D can't be used together\n");
+        exit(1);
+    }
+
+    // what the options leave out comes from the manifest, if raid left one,
+    // or the defaults
+    if (read_manifest(input_path, &m)) {
+        use_manifest(&m, &output_size, code_name, &level, &data, &block);
+    }
+
+    if (level == 0) level = 2;
+    if (code_name[0] == 0) strcpy(code_name, DEFAULT_CODE);
+    if (data == 0) data = DEFAULT_DATA;
+    if (block == 0) block = DEFAULT_BLOCK;
+
+    if (output_size == UINT64_MAX && rebuild < 0) {
+        printf("No manifest for %s, give the size with -s\n", input_path);
+        exit(1);
+    }
+
+    int ranged = offset > 0 || length < UINT64_MAX;
+
+    if (level != 2 && ranged) {
+        printf("Byte ranges can only be read from RAID 2 part files\n");
+        exit(1);
+    }
+
+    if (level != 2) {
+        block_layout layout;
+
+        if (!init_layout(&layout, level, data, block)) {
+            printf("Invalid RAID %d layout: %d data parts of %zu bytes\n", level, data, block);
+            exit(1);
+        }
+
+        if (rebuild >= layout.parts) {
+            printf("Invalid part: %d\n", rebuild);
+            exit(1);
+        }
+
+        decode_blocks(input_path, &layout, output_size, rebuild, direct);
+
+        return 0;
+    }
+
+    if (!init_code(&code, code_name)) {
+        printf("Unknown code: %s\n", code_name);
+        exit(1);
+    }
+
+    // every byte of a part file holds one bit of 8 codewords, which decode
+    // to `data` bytes of output
+    size_t chunk = CHUNK_SIZE * 4 / code.data / IO_ALIGN * IO_ALIGN;
+
+    if (chunk == 0) chunk = IO_ALIGN;
+
+    if (rebuild >= code.parts) {
+        printf("Invalid part: %d\n", rebuild);
+        exit(1);
+    }
+
+    if (rebuild >= 0) {
+        rebuild_part(input_path, &code, chunk, rebuild, direct);
+        return 0;
+    }
+
+    // the CRCs only fit part files of the code and size in the manifest
+    const uint32_t *crcs = NULL;
+
+    if (m.level == 2 && m.parts == code.parts && m.data == code.data && m.size == output_size &&
+        m.block_size == (size_t)code.data * CRC_STRIPE && m.blocks > 0) {
+        crcs = m.crcs;
+    }
+
     sprintf(output_path, "%s.%s", input_path, "2");
 
+    if (ranged) {
+        decode_range(input_path, output_path, &code, output_size, offset, length);
+        free(m.crcs);
+
+        return 0;
+    }
+
+    if (threads > 1) {
+        report = decode_parallel(input_path, output_path, &code, crcs, output_size, chunk, threads);
+        report_failed(&report);
+        free(m.crcs);
+
+        return 0;
+    }
+
     output = get_file(output_path, "w");
-    init_raid2(raid2, input_path);
+    open_parts(&raid2, input_path, code.parts, 0, direct, -1);
+    check_lost(&raid2, input_path, 1);
+
+    if (raid2.missing >= 0) {
+        printf("Missing %s.part%d, decoding without it\n", input_path, raid2.missing);
+    }
 
     /* decoding */
 
-    unsigned char hamming_code = 0;
-    unsigned char p1, p2, d1, p3, d2, d3, d4;
-    int parity_check = 0;
+    // There are two sets of stripes: the part threads read the next chunk
+    // into one while the other is decoded.
+    uint64_t stripe_size = (output_size + code.data - 1) / code.data;
+    unsigned char *stripes[2][MAX_PARTS];
+    unsigned char *output_buffer = malloc(code.data * chunk);
+    int current = 0;
 
-    // buffer for each output file
-    unsigned char buffers[7] = { 0 };
-    unsigned char output_buffer = 0;
-    int buffer_index = -1;
-    int nibble_counter = 0;
+    for (int j = 0; j < code.parts; j++) {
+        stripes[0][j] = alloc_buffer(chunk);
+        stripes[1][j] = alloc_buffer(chunk);
+    }
+
+    if (stripe_size > 0) {
+        start_parts(&raid2, stripes[0], stripe_size < chunk ? stripe_size : chunk);
+    }
+
+    for (uint64_t done = 0; done < stripe_size; ) {
+        size_t size = stripe_size - done < chunk ? stripe_size - done : chunk;
+        size_t got[MAX_PARTS];
+
+        wait_parts(&raid2, got);
+
+        if (stripe_size - done > size) {
+            uint64_t left = stripe_size - done - size;
+
+            start_parts(&raid2, stripes[!current], left < chunk ? left : chunk);
+        }
+
+        uint64_t left = output_size - code.data * done;
+        size_t output_bytes = left < code.data * size ? left : code.data * size;
+
+        decode_chunk(&code, stripes[current], got, size, output_buffer, output_bytes, raid2.missing,
+                     crcs ? crcs + done / CRC_STRIPE : NULL, &report);
+
+        if (fwrite(output_buffer, 1, output_bytes, output) != output_bytes) {
+            printf("Failed to write output\n");
+            exit(1);
+        }
+
+        done += size;
+        current = !current;
+    }
+
+    fclose(output);
+    close_parts(&raid2);
+
+    for (int j = 0; j < code.parts; j++) {
+        free(stripes[0][j]);
+        free(stripes[1][j]);
+    }
+    free(output_buffer);
+    free(m.crcs);
+
+    report_failed(&report);
+
+    return 0;
+}
+
+// decode a chunk of `size` bytes of every stripe, of which got[] were read,
+// into data * size bytes of output, `output_bytes` of which are kept. A
+// short part file reads as zeros, and the last chunk is padded to a whole
+// word (`output` needs room for it). With the manifest CRCs of the chunk's
+// blocks, a block is decoded without correction first, and again with it
+// only if it doesn't match its CRC.
+void decode_chunk(hamming_code *code, unsigned char *stripes[], size_t got[], size_t size, unsigned char *output, size_t output_bytes, int missing, const uint32_t *crcs, decode_report *report) {
+    size_t padded = (size + 7) & ~(size_t)7;
+
+    for (int j = 0; j < code->parts; j++) {
+        memset(stripes[j] + got[j], 0, padded - got[j]);
+    }
+
+    if (crcs == NULL) {
+        decode_words(code, stripes, padded, output, missing, 1, &report->failed);
+        return;
+    }
+
+    for (size_t s = 0; s < padded; s += CRC_STRIPE) {
+        unsigned char *block[MAX_PARTS];
+        size_t n = padded - s < CRC_STRIPE ? padded - s : CRC_STRIPE;
+        size_t start = code->data * s, length = output_bytes - start;
+        uint32_t crc = crcs[s / CRC_STRIPE];
+
+        if (length > code->data * n) length = code->data * n;
+
+        for (int j = 0; j < code->parts; j++) {
+            block[j] = stripes[j] + s;
+        }
+
+        // clean blocks (the common case) skip the parity checks
+        decode_words(code, block, n, output + start, missing, 0, &report->failed);
+
+        if (crc32c(0, output + start, length) == crc) continue;
+
+        decode_words(code, block, n, output + start, missing, 1, &report->failed);
+
+        if (crc32c(0, output + start, length) != crc) report->mismatched++;
+    }
+}
+
+// decode `size` bytes of every stripe with decode_stripes() for
+// Hamming(7,4), decode_code() for the rest, with or without correction
+void decode_words(hamming_code *code, unsigned char *stripes[], size_t size, unsigned char *output, int missing, int correct, uint64_t *failed) {
+    if (code->parts == 7 && code->data == 4) {
+        decode_stripes(code, stripes, size, output, missing, correct);
+    } else {
+        decode_code(code, stripes, size, output, missing, correct, failed);
+    }
+}
+
+// decode `size` bytes (a multiple of 8) of every stripe into 4 * size bytes
+// of output, correcting single bit errors in place. Each stripe holds one
+// bit position of every codeword, so 64 codewords are checked at once with
+// 64-bit words. If stripe `missing` (not -1) is lost, its bits are filled in
+// from the others instead, and nothing can be corrected. Without `correct`,
+// the codewords are taken as they are. Returns the number of corrected
+// codewords. For Hamming(7,4) only.
+uint64_t decode_stripes(hamming_code *code, unsigned char *stripes[7], size_t size, unsigned char *output, int missing, int correct) {
+    unsigned char *data[4] = { stripes[2], stripes[4], stripes[5], stripes[6] };
+    uint64_t corrected = 0;
+
+    for (size_t i = 0; i < size; i += 8) {
+        uint64_t words[7];
+
+        for (int j = 0; j < 7; j++) {
+            memcpy(&words[j], stripes[j] + i, 8);
+        }
+
+        if (missing >= 0) {
+            fill_erasure(code, words, missing);
+            memcpy(stripes[missing] + i, &words[missing], 8);
+        }
+
+        // clean words (the common case) are left alone
+        uint64_t errors = missing < 0 && correct ? correct_words(words) : 0;
+
+        if (errors != 0) {
+            corrected += __builtin_popcountll(errors);
 
-    for (int i = 0; i < output_size * 2; i++) {
-        // if the current byte has been fully processed, read next byte from
-        // each RAID file
-        if (buffer_index < 0) {
             for (int j = 0; j < 7; j++) {
-                buffers[j] = fgetc(raid2[j]);
+                memcpy(stripes[j] + i, &words[j], 8);
             }
-            buffer_index = 7;
         }
 
-        hamming_code = 0;
+        for (size_t k = i; k < i + 8; k++) {
+            unstripe(data, k, output + 4 * k);
+        }
+    }
+
+    return corrected;
+}
 
-        // assemble hamming code by grabbing 1 bit from each RAID file
-        for (int j = 0; j < 7; j++) {
-            hamming_code |= (buffers[j] >> buffer_index) & 1;
-            hamming_code <<= 1;
+// check the parity of the 64 codewords in `words` (one word per stripe) and
+// flip the data bits the syndromes point at. Returns the mask of codewords
+// that had an error.
+uint64_t correct_words(uint64_t words[7]) {
+    uint64_t p1 = words[0], p2 = words[1], d1 = words[2], p3 = words[3];
+    uint64_t d2 = words[4], d3 = words[5], d4 = words[6];
+
+    /* error detection */
+
+    // bit k of syndrome s is set if parity check s fails for codeword k
+    uint64_t s1 = p1 ^ d1 ^ d2 ^ d4;
+    uint64_t s2 = p2 ^ d1 ^ d3 ^ d4;
+    uint64_t s3 = p3 ^ d2 ^ d3 ^ d4;
+
+    if ((s1 | s2 | s3) == 0) return 0;
+
+    /* error correction */
+
+    // the syndromes spell out the position of the flipped bit (1-7); only
+    // data bits need fixing, the parity bits aren't part of the output
+    words[2] ^= s1 & s2 & ~s3;
+    words[4] ^= s1 & ~s2 & s3;
+    words[5] ^= ~s1 & s2 & s3;
+    words[6] ^= s1 & s2 & s3;
+
+    return s1 | s2 | s3;
+}
+
+// decode_stripes() for any code: `size` bytes (a multiple of 8) of every
+// stripe decode to data * size bytes of output. Codewords with more errors
+// than the code can correct, where it can tell, are counted in `failed`.
+uint64_t decode_code(hamming_code *code, unsigned char *stripes[], size_t size, unsigned char *output, int missing, int correct, uint64_t *failed) {
+    uint64_t corrected = 0;
+
+    for (size_t i = 0; i < size; i += 8) {
+        uint64_t words[MAX_PARTS], rows[64] = { 0 };
+
+        for (int j = 0; j < code->parts; j++) {
+            memcpy(&words[j], stripes[j] + i, 8);
         }
 
-        hamming_code >>= 1;
-        buffer_index--;
+        if (missing >= 0) {
+            fill_erasure(code, words, missing);
+            memcpy(stripes[missing] + i, &words[missing], 8);
+        } else if (correct) {
+            uint64_t errors = correct_code(code, words, 0, failed);
 
-        p1 = hamming_code >> 6 & 1;
-        p2 = hamming_code >> 5 & 1;
-        d1 = hamming_code >> 4 & 1;
-        p3 = hamming_code >> 3 & 1;
-        d2 = hamming_code >> 2 & 1;
-        d3 = hamming_code >> 1 & 1;
-        d4 = hamming_code & 1;
+            if (errors != 0) {
+                corrected += __builtin_popcountll(errors);
 
-        /* error detection */
+                for (int j = 0; j < code->parts; j++) {
+                    memcpy(stripes[j] + i, &words[j], 8);
+                }
+            }
+        }
 
-        if (p1 != (d1 ^ d2 ^ d4)) parity_check += 1;
-        if (p2 != (d1 ^ d3 ^ d4)) parity_check += 2;
-        if (p3 != (d2 ^ d3 ^ d4)) parity_check += 4;
+        // one row per data bit, the first codeword on top (the stripes are
+        // big-endian); the transpose turns them into one row per codeword
+        for (int j = 0; j < code->data; j++) {
+            rows[j] = be64toh(words[code->data_parts[j]]);
+        }
 
-        /* error correction */
+        transpose64(rows, code->data, 1);
+        put_bits(rows, code->data, output + i * code->data);
+    }
 
-        switch (parity_check) {
-            case 1:
-                p1 = !p1;
-                break;
-            case 2:
-                p2 = !p2;
-                break;
-            case 3:
-                d1 = !d1;
-                break;
-            case 4:
-                p3 = !p3;
-                break;
-            case 5:
-                d2 = !d2;
-                break;
-            case 6:
-                d3 = !d3;
-                break;
-            case 7:
-                d4 = !d4;
-                break;
+    return corrected;
+}
+
+// decode chunks on `threads` threads at once, each reading its chunks and
+// writing their output with pread and pwrite at their own offsets. Returns
+// what the threads found between them.
+decode_report decode_parallel(char input_path[], char output_path[], hamming_code *code, const uint32_t *crcs, uint64_t output_size, size_t chunk, int threads) {
+    pthread_t workers[64];
+    decoder d = { 0 };
+
+    d.code = code;
+    d.crcs = crcs;
+    d.missing = -1;
+
+    if (open_part_files(d.fds, input_path, code->parts, O_RDONLY) > 1) {
+        printf("Too many missing part files of %s\n", input_path);
+        exit(1);
+    }
+
+    for (int j = 0; j < code->parts; j++) {
+        if (d.fds[j] < 0) {
+            d.missing = j;
+            printf("Missing %s.part%d, decoding without it\n", input_path, j);
         }
+    }
+
+    d.output = open(output_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
 
-        /* assemble output buffer */
+    if (d.output < 0) {
+        printf("Failed to open file: %s\n", output_path);
+        exit(1);
+    }
 
-        if (nibble_counter == 0) {
-            output_buffer = d1 << 7 | d2 << 6 | d3 << 5 | d4 << 4;
-            nibble_counter++;
-        } else if (nibble_counter == 1) {
-            output_buffer |= d1 << 3 | d2 << 2 | d3 << 1 | d4;
-            fputc(output_buffer, output);
-            nibble_counter = 0;
+    d.output_size = output_size;
+    d.stripe_size = (output_size + code->data - 1) / code->data;
+    d.chunk = chunk;
+    pthread_mutex_init(&d.lock, NULL);
+
+    for (int t = 0; t < threads; t++) {
+        pthread_create(&workers[t], NULL, decode_worker, &d);
+    }
+
+    for (int t = 0; t < threads; t++) {
+        pthread_join(workers[t], NULL);
+    }
+
+    for (int j = 0; j < code->parts; j++) {
+        if (d.fds[j] >= 0) close(d.fds[j]);
+    }
+    close(d.output);
+    pthread_mutex_destroy(&d.lock);
+
+    return d.report;
+}
+
+// thread of a parallel decoding: decode the next chunk until there are none
+// left
+void *decode_worker(void *arg) {
+    decoder *d = arg;
+    hamming_code *code = d->code;
+    unsigned char *stripes[MAX_PARTS];
+    unsigned char *output_buffer = malloc(code->data * d->chunk);
+    decode_report report = { 0 };
+
+    for (int j = 0; j < code->parts; j++) {
+        stripes[j] = alloc_buffer(d->chunk);
+    }
+
+    while (1) {
+        pthread_mutex_lock(&d->lock);
+        uint64_t k = d->next_chunk++;
+        pthread_mutex_unlock(&d->lock);
+
+        uint64_t offset = k * d->chunk;
+
+        if (offset >= d->stripe_size) break;
+
+        size_t size = d->stripe_size - offset < d->chunk ? d->stripe_size - offset : d->chunk;
+        size_t got[MAX_PARTS];
+
+        for (int j = 0; j < code->parts; j++) {
+            got[j] = read_part(d->fds[j], stripes[j], size, offset);
         }
+
+        uint64_t left = d->output_size - code->data * offset;
+        size_t output_bytes = left < code->data * size ? left : code->data * size;
+
+        decode_chunk(code, stripes, got, size, output_buffer, output_bytes, d->missing,
+                     d->crcs ? d->crcs + offset / CRC_STRIPE : NULL, &report);
+
+        write_part(d->output, output_buffer, output_bytes, code->data * offset);
+    }
+
+    for (int j = 0; j < code->parts; j++) {
+        free(stripes[j]);
+    }
+    free(output_buffer);
+
+    pthread_mutex_lock(&d->lock);
+    d->report.failed += report.failed;
+    d->report.mismatched += report.mismatched;
+    pthread_mutex_unlock(&d->lock);
+
+    return NULL;
+}
+
+// decode bytes `offset` to offset + length - 1 of the original file (cut
+// short at its end) into `output_path` with read_range(), which reads just
+// the words of the part files that hold them
+void decode_range(char input_path[], char output_path[], hamming_code *code, uint64_t output_size, uint64_t offset, uint64_t length) {
+    int fds[MAX_PARTS];
+    unsigned char *output_buffer = malloc(CHUNK_SIZE), *scratch = alloc_buffer(RANGE_SCRATCH_SIZE);
+    decode_report report = { 0 };
+    FILE *output;
+
+    if (open_part_files(fds, input_path, code->parts, O_RDONLY) > 1) {
+        printf("Too many missing part files of %s\n", input_path);
+        exit(1);
+    }
+
+    for (int j = 0; j < code->parts; j++) {
+        if (fds[j] < 0) printf("Missing %s.part%d, decoding without it\n", input_path, j);
+    }
+
+    output = get_file(output_path, "w");
+
+    if (offset > output_size) offset = output_size;
+    if (length > output_size - offset) length = output_size - offset;
+
+    for (uint64_t done = 0; done < length; ) {
+        size_t size = length - done < CHUNK_SIZE ? length - done : CHUNK_SIZE;
+
+        size = read_range(code, fds, output_size, offset + done, size, output_buffer, scratch, &report.failed);
+
+        if (fwrite(output_buffer, 1, size, output) != size) {
+            printf("Failed to write output\n");
+            exit(1);
+        }
+
+        done += size;
     }
 
     fclose(output);
-    for (int i = 0; i < 7; i++) fclose(raid2[i]);
 
-    return 0;
+    for (int j = 0; j < code->parts; j++) {
+        if (fds[j] >= 0) close(fds[j]);
+    }
+    free(output_buffer);
+    free(scratch);
+
+    report_failed(&report);
+}
+
+// regenerate `input_path`.part<part> from the other part files in one pass:
+// the parts are read ahead in chunks while the previous chunk is filled in
+// and written
+void rebuild_part(char input_path[], hamming_code *code, size_t chunk, int part, int direct) {
+    char path[256] = { 0 };
+    unsigned char *stripes[2][MAX_PARTS];
+    int current = 0;
+    uint64_t written = 0;
+    FILE *output;
+    part_set raid2;
+
+    open_parts(&raid2, input_path, code->parts, 0, direct, part);
+    check_lost(&raid2, input_path, 1);
+
+    snprintf(path, sizeof(path), "%s.part%d", input_path, part);
+    output = get_file(path, "w");
+
+    for (int j = 0; j < code->parts; j++) {
+        stripes[0][j] = alloc_buffer(chunk);
+        stripes[1][j] = alloc_buffer(chunk);
+    }
+
+    start_parts(&raid2, stripes[0], chunk);
+
+    while (1) {
+        size_t got[MAX_PARTS], size = 0;
+
+        wait_parts(&raid2, got);
+
+        // the part files end together; a short one reads as zeros
+        for (int j = 0; j < code->parts; j++) {
+            if (got[j] > size) size = got[j];
+        }
+
+        if (size == 0) break;
+
+        start_parts(&raid2, stripes[!current], chunk);
+
+        size_t padded = (size + 7) & ~(size_t)7;
+
+        for (int j = 0; j < code->parts; j++) {
+            memset(stripes[current][j] + got[j], 0, padded - got[j]);
+        }
+
+        for (size_t i = 0; i < padded; i += 8) {
+            uint64_t words[MAX_PARTS];
+
+            for (int j = 0; j < code->parts; j++) {
+                memcpy(&words[j], stripes[current][j] + i, 8);
+            }
+
+            fill_erasure(code, words, part);
+            memcpy(stripes[current][part] + i, &words[part], 8);
+        }
+
+        if (fwrite(stripes[current][part], 1, size, output) != size) {
+            printf("Failed to write %s\n", path);
+            exit(1);
+        }
+
+        written += size;
+        current = !current;
+    }
+
+    fclose(output);
+    close_parts(&raid2);
+
+    for (int j = 0; j < code->parts; j++) {
+        free(stripes[0][j]);
+        free(stripes[1][j]);
+    }
+
+    printf("Rebuilt %s (%llu bytes)\n", path, (unsigned long long)written);
+}
+
+// RAID 5/6 decoding: read the part files a batch of stripes at a time (the
+// next batch while the last one is worked on), fill in the lost parts and
+// write out the data blocks of every stripe, or with `rebuild` (not -1),
+// write part `rebuild` back instead
+void decode_blocks(char input_path[], block_layout *layout, uint64_t output_size, int rebuild, int direct) {
+    char path[256] = { 0 };
+    size_t block = layout->block, stripe_size = layout->data * block, stripes = 1;
+    unsigned char *parts[2][MAX_PARTS];
+    int lost[MAX_PARTS], count = 0, current = 0;
+    uint64_t done = 0, written = 0;
+    FILE *output;
+    part_set set;
+
+    open_parts(&set, input_path, layout->parts, 0, direct, rebuild);
+    check_lost(&set, input_path, layout->level - 4);
+
+    for (int i = 0; i < layout->parts; i++) {
+        if (set.parts[i].fd >= 0) continue;
+
+        lost[count++] = i;
+
+        if (i != rebuild) {
+            printf("Missing %s.part%d, decoding without it\n", input_path, i);
+        }
+    }
+
+    if (rebuild >= 0) {
+        snprintf(path, sizeof(path), "%s.part%d", input_path, rebuild);
+    } else {
+        snprintf(path, sizeof(path), "%s.2", input_path);
+    }
+
+    output = get_file(path, "w");
+
+    // a power of 2 of stripes per batch keeps the part files aligned for
+    // direct I/O. A rebuild reads to the end of the part files.
+    while (2 * stripes * stripe_size <= 4 * CHUNK_SIZE) stripes *= 2;
+
+    size_t batch = stripes * block;
+    uint64_t part_size = rebuild >= 0 ? UINT64_MAX : (output_size + stripe_size - 1) / stripe_size * block;
+    unsigned char *output_buffer = malloc(stripes * stripe_size);
+
+    for (int i = 0; i < layout->parts; i++) {
+        parts[0][i] = alloc_buffer(batch);
+        parts[1][i] = alloc_buffer(batch);
+    }
+
+    if (part_size > 0) {
+        start_parts(&set, parts[0], part_size < batch ? part_size : batch);
+    }
+
+    while (done < part_size) {
+        size_t size = part_size - done < batch ? part_size - done : batch;
+        size_t got[MAX_PARTS];
+
+        wait_parts(&set, got);
+
+        if (rebuild >= 0) {
+            size = 0;
+
+            for (int i = 0; i < layout->parts; i++) {
+                if (got[i] > size) size = got[i];
+            }
+
+            if (size == 0) break;
+        }
+
+        if (part_size - done > size) {
+            uint64_t left = part_size - done - size;
+
+            start_parts(&set, parts[!current], left < batch ? left : batch);
+        }
+
+        // a short part file reads as zeros
+        for (int i = 0; i < layout->parts; i++) {
+            if (got[i] < size) memset(parts[current][i] + got[i], 0, size - got[i]);
+        }
+
+        if (count > 0) recover_parts(layout, parts[current], size, lost, count);
+
+        if (rebuild >= 0) {
+            if (fwrite(parts[current][rebuild], 1, size, output) != size) {
+                printf("Failed to write %s\n", path);
+                exit(1);
+            }
+
+            written += size;
+        } else {
+            size_t used = size / block;
+
+            for (size_t s = 0; s < used; s++) {
+                for (int i = 0; i < layout->data; i++) {
+                    memcpy(output_buffer + (s * layout->data + i) * block, parts[current][i] + s * block, block);
+                }
+            }
+
+            size_t output_bytes = output_size - written < used * stripe_size ? output_size - written : used * stripe_size;
+
+            if (fwrite(output_buffer, 1, output_bytes, output) != output_bytes) {
+                printf("Failed to write output\n");
+                exit(1);
+            }
+
+            written += output_bytes;
+        }
+
+        done += size;
+        current = !current;
+    }
+
+    fclose(output);
+    close_parts(&set);
+
+    for (int i = 0; i < layout->parts; i++) {
+        free(parts[0][i]);
+        free(parts[1][i]);
+    }
+    free(output_buffer);
+
+    if (rebuild >= 0) {
+        printf("Rebuilt %s (%llu bytes)\n", path, (unsigned long long)written);
+    }
+}
+
+// warn about codewords that couldn't be corrected (SECDED and shortened
+// codes can tell) and blocks that came out wrong anyway
+void report_failed(decode_report *report) {
+    if (report->failed > 0) {
+        printf("%llu codewords had more errors than could be corrected\n", (unsigned long long)report->failed);
+    }
+
+    if (report->mismatched > 0) {
+        printf("%llu blocks don't match their CRC\n", (unsigned long long)report->mismatched);
+    }
+}
+
+// fill in the size, code and layout the options left out from manifest `m`.
+// The code or layout only fit the level it was written with.
+void use_manifest(manifest *m, uint64_t *size, char *code_name, int *level, int *data, size_t *block) {
+    if (*size == UINT64_MAX) *size = m->size;
+    if (*level == 0) *level = m->level;
+    if (*level != m->level) return;
+
+    if (m->level == 2 && code_name[0] == 0) {
+        snprintf(code_name, 32, "%d,%d", m->parts, m->data);
+    }
+
+    if (m->level != 2) {
+        if (*data == 0) *data = m->data;
+        if (*block == 0) *block = m->block_size;
+    }
+}
+
+// exit if more part files are missing than can be done without
+void check_lost(part_set *set, char input_path[], int spare) {
+    if (set->lost > spare) {
+        printf("Too many missing part files of %s\n", input_path);
+        exit(1);
+    }
 }
 
-// initialize an array of 7 files representing 7 RAID 2 drives
-void init_raid2(FILE *raid2[7], char basename[128]) {
-    char output_path[256] = { 0 };
+// turn byte `index` of the 4 data stripes (8 codewords) into 4 output
+// bytes, two nibbles each
+void unstripe(unsigned char *data[4], size_t index, unsigned char *output) {
+    // with the data bits in the low rows, the transpose leaves the nibble of
+    // codeword k in byte k (from the top)
+    uint64_t x = (uint64_t)data[0][index] << 24 | data[1][index] << 16 | data[2][index] << 8 | data[3][index];
 
-    for (int i = 0; i < 7; i++) {
-        sprintf(output_path, "%s.part%d", basename, i);
-        raid2[i] = get_file(output_path, "r");
+    x = transpose8(x);
+
+    for (int j = 0; j < 4; j++) {
+        output[j] = (x >> (56 - 16 * j)) << 4 | ((x >> (48 - 16 * j)) & 15);
     }
 }
 
@@ -145,28 +845,77 @@ FILE *get_file(char path[], char mode[]) {
 
 // process the command line options (or fall back to default values):
 //      -f <path>: input file
-void get_args(int argc, char **argv, char *input_path, int *size) {
+//      -s <bytes>: size of the original file (the manifest knows it)
+//      -c <parts,data>: code the part files were written with (see raid.c)
+//      -l <level>, -n <parts>, -b <bytes>: RAID level, number of data parts
+//          and block size the part files were written with (see raid.c)
+//      -j <threads>: decode on this many threads (1-64) with pread and
+//          pwrite, through the page cache (RAID 2 only, not with -D)
+//      -R <part>: rebuild part file <part> from the others instead of
+//          decoding
+//      -o <bytes>, -L <bytes>: decode only the range of the original file
+//          from this offset on, this long (RAID 2 only)
+//      -D: read the part files with direct I/O (O_DIRECT), bypassing the page
+//          cache
+void get_args(int argc, char **argv, char *input_path, uint64_t *size, char *code_name, int *level, int *data, size_t *block, int *threads, int *rebuild, int *direct, uint64_t *offset, uint64_t *length) {
     int opt;
 
     // check if input/output paths are given
-    while ((opt = getopt(argc, argv, "f:s:")) != -1) {
+    while ((opt = getopt(argc, argv, "f:s:c:l:n:b:j:R:o:L:D")) != -1) {
 
         switch (opt) {
             case 'f':
                 strcpy(input_path, optarg);
                 break;
             case 's':
-                *size = atoi(optarg);
+                *size = strtoull(optarg, NULL, 10);
+                break;
+            case 'c':
+                snprintf(code_name, 32, "%s", optarg);
+                break;
+            case 'l':
+                *level = atoi(optarg);
+                break;
+            case 'n':
+                *data = atoi(optarg);
+                break;
+            case 'b':
+                *block = strtoull(optarg, NULL, 10);
+                break;
+            case 'j':
+                *threads = atoi(optarg);
+
+                if (*threads < 1 || *threads > 64) {
+                    printf("Invalid number of threads: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'R':
+                *rebuild = atoi(optarg);
+
+                if (*rebuild < 0) {
+                    printf("Invalid part: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'o':
+                *offset = strtoull(optarg, NULL, 10);
+                break;
+            case 'L':
+                *length = strtoull(optarg, NULL, 10);
+                break;
+            case 'D':
+                *direct = 1;
                 break;
             default:
-                printf("Usage: %s [-f filename]\n", argv[0]);
+                printf("Usage: %s [-f filename] [-s size] [-c code] [-l level] [-n parts] [-b bytes] [-j threads] [-R part] [-o offset] [-L length] [-D]\n", argv[0]);
 
                 exit(1);
         }
 
     }
 
-    // use default values if no input
+    // use default values if no input (the rest may come from the manifest)
     if (input_path[0] == 0) {
         strcpy(input_path, DEFAULT_IN);
     }
@@ -1,75 +1,206 @@
 /*
 raid.c: encode a file using Hamming(7, 4) and write it across 7 files (emulating RAID 2).
+Codewords come from a 16-entry table and are striped with a bit-matrix transpose
+(32 codewords at a time with AVX2). Wider codes, (15,11), (31,26) and SECDED
+(72,64) among them, are encoded 64 codewords at a time with a 64x64 transpose.
+With -j, chunks of the file are encoded by several threads, each writing its
+stripes to the part files at their own offsets. With -l 5 or 6, the file is
+striped in blocks instead, with RAID 5 or 6 parity (see raid56.h). The size of
+the file, the code or layout, and a CRC32C of every block of the file go to
+filename.manifest, for diar.
 
 Usage:
-    ./raid -f filename (default: test.txt)
+    ./raid -f filename (default: test.txt) [-c code (default: 7,4)] [-j threads] [-D (direct I/O)]
+    ./raid -f filename -l 5|6 [-n data parts (default: 4)] [-b block size (default: 65536)] [-D]
 */
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <endian.h>
 #include <getopt.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#include "raid2.h"
+#include "raid56.h"
 
 #define DEFAULT_IN "test.txt"
 
-void init_raid2(FILE *raid2[7], char basename[128]);
+// the input is read and striped about this many bytes at a time. Every 4
+// input bytes (`data` bytes for other codes) make one byte of each part
+// file, so only the last chunk can end in a partial stripe byte.
+#define CHUNK_SIZE (1 << 20)
+#define DEFAULT_CODE "7,4"
+#define DEFAULT_DATA 4
+#define DEFAULT_BLOCK 65536
+
+// Hamming(7,4) codeword of every nibble
+unsigned char codewords[16];
+
+// the state shared by the threads of a parallel encoding: chunk k of the
+// input is encoded into stripe bytes from k * stripe_chunk on
+struct encoder {
+    hamming_code *code;
+    manifest *m;
+    int input;
+    int fds[MAX_PARTS];
+    uint64_t size;
+    size_t chunk, stripe_chunk;
+
+    pthread_mutex_t lock;
+    uint64_t next_chunk;
+} typedef encoder;
+
+void init_codewords(void);
 unsigned char encode_nibble(unsigned char nibble); 
 
-void get_arg_paths(int argc, char **argv, char *input_path);
+size_t stripe_any(hamming_code *code, unsigned char *input, size_t size, unsigned char *stripes[]);
+size_t stripe(const unsigned char *input, size_t size, unsigned char *stripes[7]);
+void stripe4(const unsigned char *input, unsigned char *stripes[7], size_t index);
+void stripe16_avx2(const unsigned char *input, unsigned char *stripes[7], size_t index);
+
+size_t stripe_code(hamming_code *code, unsigned char *input, size_t size, unsigned char *stripes[]);
+void stripe64(hamming_code *code, const unsigned char *input, unsigned char *stripes[], size_t index);
+uint64_t get_bits(const unsigned char *input, size_t bit, int count);
+
+void checksum_blocks(manifest *m, const unsigned char *input, size_t size, uint64_t offset);
+
+void encode_parallel(char input_path[], hamming_code *code, manifest *m, size_t stripe_chunk, int threads);
+void *encode_worker(void *arg);
+
+uint64_t encode_blocks(FILE *input, char input_path[], block_layout *layout, int direct);
+
+void get_arg_paths(int argc, char **argv, char *input_path, char *code_name, int *level, int *data, size_t *block, int *threads, int *direct);
 FILE *get_file(char path[], char mode[]);
 
 int main(int argc, char **argv) {
-    char ch, input_path[128] = { 0 };
-    FILE *input, *raid2[7];
+    char input_path[128] = { 0 }, code_name[32] = { 0 };
+    int level = 2, data = DEFAULT_DATA, threads = 1, direct = 0;
+    size_t block = DEFAULT_BLOCK;
+    FILE *input;
+    hamming_code code;
+    part_set raid2;
+    manifest m = { 0 };
 
     /* setup */
 
-    get_arg_paths(argc, argv, input_path);
+    get_arg_paths(argc, argv, input_path, code_name, &level, &data, &block, &threads, &direct);
 
-    input = get_file(input_path, "r");
-    init_raid2(raid2, input_path);
+    // the threads share their file descriptors, which can't switch to the
+    // page cache for the unaligned end of a part file one thread at a time
+    if (threads > 1 && direct) {
+        printf("-j and -D can't be used together\n");
+        exit(1);
+    }
 
-    /* encoding */
+    if (level != 2) {
+        block_layout layout;
+
+        if (!init_layout(&layout, level, data, block)) {
+            printf("Invalid RAID %d layout: %d data parts of %zu bytes\n", level, data, block);
+            exit(1);
+        }
 
-    // buffer for each output file
-    unsigned char buffers[7] = { 0 };
-    int buffer_index = 0;
+        input = get_file(input_path, "r");
+        m = (manifest){ level, layout.parts, data, block, 0, 0, NULL };
 
-    // buffer for each nibble of a byte
-    unsigned char nibbles[2] = { 0 };
+        m.size = encode_blocks(input, input_path, &layout, direct);
+        fclose(input);
+        write_manifest(input_path, &m);
 
-    // read a byte from input
-    while ((ch = fgetc(input)) != EOF) {
-        nibbles[0] = ch >> 4;
-        nibbles[1] = ch & 15;
+        return 0;
+    }
 
-        // for each nibble (2 per byte)
-        for (int n = 0; n < 2; n++) {
-            // write each bit of the encoded nibble to its corresponding file buffer
-            for (int i = 0; i < 7; i++) {
-                buffers[i] |= (encode_nibble(nibbles[n]) >> (6 - i) & 1) << (7 - buffer_index);
-            }
+    if (!init_code(&code, code_name)) {
+        printf("Unknown code: %s\n", code_name);
+        exit(1);
+    }
 
-            buffer_index++;
+    init_codewords();
 
-            // if buffers are full, write them to file & reset them
-            if (buffer_index == 8) {
-                for (int i = 0; i < 7; i++) {
-                    putc(buffers[i], raid2[i]);
-                    buffers[i] = 0;
-                }
+    // every chunk of input turns into a chunk of each part file. The stripe
+    // chunks stay aligned for direct I/O.
+    size_t stripe_chunk = CHUNK_SIZE / code.data / IO_ALIGN * IO_ALIGN;
 
-                buffer_index = 0;
-            }
-        }
+    if (stripe_chunk == 0) stripe_chunk = IO_ALIGN;
+
+    // a CRC for the input behind every CRC_STRIPE bytes of the part files,
+    // so every chunk is made of whole blocks
+    m.level = 2;
+    m.parts = code.parts;
+    m.data = code.data;
+    m.block_size = code.data * CRC_STRIPE;
+
+    if (threads > 1) {
+        encode_parallel(input_path, &code, &m, stripe_chunk, threads);
+        write_manifest(input_path, &m);
+        free(m.crcs);
+
+        return 0;
+    }
+
+    input = get_file(input_path, "r");
+    open_parts(&raid2, input_path, code.parts, 1, direct, -1);
+
+    /* encoding */
+
+    // There are two sets of stripes: one is encoded into while the part
+    // threads write out the other. The input buffer has room to pad the
+    // last block of codewords.
+    size_t chunk = code.data * stripe_chunk;
+    unsigned char *input_buffer = malloc(chunk + 8 * code.data + 8);
+    unsigned char *stripes[2][MAX_PARTS];
+    int current = 0;
+    uint64_t offset = 0;
+    size_t size;
+
+    for (int i = 0; i < code.parts; i++) {
+        stripes[0][i] = alloc_buffer(stripe_chunk);
+        stripes[1][i] = alloc_buffer(stripe_chunk);
+    }
+
+    while ((size = fread(input_buffer, 1, chunk, input)) > 0) {
+        checksum_blocks(&m, input_buffer, size, offset);
+
+        size_t stripe_size = stripe_any(&code, input_buffer, size, stripes[current]);
+
+        wait_parts(&raid2, NULL);
+        start_parts(&raid2, stripes[current], stripe_size);
+        current = !current;
+        offset += size;
     }
 
     // close all files
     fclose(input);
-    for (int i = 0; i < 7; i++) fclose(raid2[i]);
+    close_parts(&raid2);
+
+    // the input may have been a pipe, so its size is what was read
+    m.size = offset;
+    write_manifest(input_path, &m);
+
+    for (int i = 0; i < code.parts; i++) {
+        free(stripes[0][i]);
+        free(stripes[1][i]);
+    }
+    free(input_buffer);
+    free(m.crcs);
 
     return 0;
 }
 
+// fill the codeword table
+void init_codewords(void) {
+    for (int i = 0; i < 16; i++) {
+        codewords[i] = encode_nibble(i);
+    }
+}
+
 // encode a nibble using Hamming(7,4)
 unsigned char encode_nibble(unsigned char nibble) {
     unsigned char encoded_nibble = 0;
@@ -83,16 +214,345 @@ unsigned char encode_nibble(unsigned char nibble) {
     return encoded_nibble;
 }
 
-// initialize an array of 7 files representing 7 RAID 2 drives
-void init_raid2(FILE *raid2[7], char basename[128]) {
-    char output_path[128] = { 0 };
+// CRC the blocks of the `size` bytes of input at `offset` (a whole number
+// of blocks in, so only the last one can be short) into the manifest. Its
+// CRCs grow to fit (doubling, so there is room for the next power of 2
+// of blocks), unless they already have room, as in encode_parallel().
+void checksum_blocks(manifest *m, const unsigned char *input, size_t size, uint64_t offset) {
+    uint64_t blocks = (offset + size + m->block_size - 1) / m->block_size;
+
+    if (blocks > m->blocks) {
+        uint64_t room = 1;
+
+        while (room < m->blocks) room *= 2;
+
+        if (blocks > room || m->crcs == NULL) {
+            while (room < blocks) room *= 2;
+
+            m->crcs = realloc(m->crcs, 4 * room);
+
+            if (m->crcs == NULL) {
+                printf("Out of memory\n");
+                exit(1);
+            }
+        }
+
+        m->blocks = blocks;
+    }
+
+    for (size_t b = 0; b < size; b += m->block_size) {
+        size_t n = size - b < m->block_size ? size - b : m->block_size;
+
+        m->crcs[(offset + b) / m->block_size] = crc32c(0, input + b, n);
+    }
+}
+
+// encode input chunks on `threads` threads at once, each reading its chunks
+// and writing their stripes with pread and pwrite at their own offsets (and
+// filling in their CRCs in `m`). The input has to be a regular file, which
+// is encoded at the size it has to start with.
+void encode_parallel(char input_path[], hamming_code *code, manifest *m, size_t stripe_chunk, int threads) {
+    pthread_t workers[64];
+    struct stat st;
+    encoder e = { 0 };
+
+    e.code = code;
+    e.m = m;
+    e.input = open(input_path, O_RDONLY);
+
+    if (e.input < 0 || fstat(e.input, &st) != 0) {
+        printf("Failed to open file: %s\n", input_path);
+        exit(1);
+    }
+
+    if (!S_ISREG(st.st_mode)) {
+        printf("-j needs a regular file to read from: %s\n", input_path);
+        exit(1);
+    }
+
+    // the CRCs have room for all blocks up front, so the threads only fill
+    // them in
+    m->size = st.st_size;
+    m->blocks = (m->size + m->block_size - 1) / m->block_size;
+    m->crcs = malloc(4 * m->blocks + 1);
+
+    open_part_files(e.fds, input_path, code->parts, O_WRONLY | O_CREAT | O_TRUNC);
+
+    e.size = st.st_size;
+    e.stripe_chunk = stripe_chunk;
+    e.chunk = code->data * stripe_chunk;
+    pthread_mutex_init(&e.lock, NULL);
+
+    for (int t = 0; t < threads; t++) {
+        pthread_create(&workers[t], NULL, encode_worker, &e);
+    }
+
+    for (int t = 0; t < threads; t++) {
+        pthread_join(workers[t], NULL);
+    }
+
+    for (int i = 0; i < code->parts; i++) {
+        close(e.fds[i]);
+    }
+    close(e.input);
+    pthread_mutex_destroy(&e.lock);
+}
+
+// thread of a parallel encoding: encode the next chunk until there are
+// none left
+void *encode_worker(void *arg) {
+    encoder *e = arg;
+    unsigned char *input_buffer = malloc(e->chunk + 8 * e->code->data + 8);
+    unsigned char *stripes[MAX_PARTS];
+
+    for (int i = 0; i < e->code->parts; i++) {
+        stripes[i] = alloc_buffer(e->stripe_chunk);
+    }
+
+    while (1) {
+        pthread_mutex_lock(&e->lock);
+        uint64_t k = e->next_chunk++;
+        pthread_mutex_unlock(&e->lock);
+
+        if (k * e->chunk >= e->size) break;
+
+        size_t size = e->size - k * e->chunk < e->chunk ? e->size - k * e->chunk : e->chunk;
+
+        if (read_part(e->input, input_buffer, size, k * e->chunk) != size) {
+            printf("Input file shrank while being encoded\n");
+            exit(1);
+        }
+
+        checksum_blocks(e->m, input_buffer, size, k * e->chunk);
+
+        size_t stripe_size = stripe_any(e->code, input_buffer, size, stripes);
+
+        for (int i = 0; i < e->code->parts; i++) {
+            write_part(e->fds[i], stripes[i], stripe_size, k * e->stripe_chunk);
+        }
+    }
+
+    for (int i = 0; i < e->code->parts; i++) {
+        free(stripes[i]);
+    }
+    free(input_buffer);
+
+    return NULL;
+}
+
+// encode `size` bytes of input into the stripes of `code`: stripe() for
+// Hamming(7,4), stripe_code() (which needs room after the input) for the rest
+size_t stripe_any(hamming_code *code, unsigned char *input, size_t size, unsigned char *stripes[]) {
+    if (code->parts == 7 && code->data == 4) return stripe(input, size, stripes);
+
+    return stripe_code(code, input, size, stripes);
+}
+
+// encode `size` bytes of input into the 7 stripes: bit 6 - i of every
+// codeword goes to stripes[i], 8 codewords (4 input bytes) per stripe byte,
+// the first one in the top bit. A partial last stripe byte is padded with
+// zeros. Returns the number of bytes written to each stripe.
+size_t stripe(const unsigned char *input, size_t size, unsigned char *stripes[7]) {
+    size_t i = 0;
+
+#if defined(__x86_64__) || defined(__i386__)
+    if (__builtin_cpu_supports("avx2")) {
+        for (; size - i >= 16; i += 16) {
+            stripe16_avx2(input + i, stripes, i / 4);
+        }
+    }
+#endif
+
+    for (; size - i >= 4; i += 4) {
+        stripe4(input + i, stripes, i / 4);
+    }
+
+    // the missing nibbles of the last byte encode to all zeros
+    if (i < size) {
+        unsigned char last[4] = { 0 };
+
+        memcpy(last, input + i, size - i);
+        stripe4(last, stripes, i / 4);
+        i += 4;
+    }
+
+    return i / 4;
+}
+
+// stripe the 8 codewords of 4 input bytes into byte `index` of every stripe
+void stripe4(const unsigned char *input, unsigned char *stripes[7], size_t index) {
+    uint64_t x = 0;
+
+    // one codeword per byte, the first one on top
+    for (int j = 0; j < 4; j++) {
+        x = x << 16 | codewords[input[j] >> 4] << 8 | codewords[input[j] & 15];
+    }
+
+    // after the transpose, byte 7 - b (from the top) holds bit b of all 8
+    // codewords; bit 7 is unused
+    x = transpose8(x);
 
     for (int i = 0; i < 7; i++) {
-        sprintf(output_path, "%s.part%d", basename, i);
-        raid2[i] = get_file(output_path, "w");
+        stripes[i][index] = x >> (8 * (6 - i));
     }
 }
 
+#if defined(__x86_64__) || defined(__i386__)
+// AVX2 version for 16 input bytes (4 bytes of every stripe): the nibbles are
+// looked up in the codeword table with a byte shuffle, and the bits of
+// every stripe are collected from the 32 codewords with one movemask
+__attribute__((target("avx2")))
+void stripe16_avx2(const unsigned char *input, unsigned char *stripes[7], size_t index) {
+    const __m256i table = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)codewords));
+
+    // movemask puts codeword k in bit k, but the first codeword of each
+    // stripe byte belongs in its top bit, so every group of 8 is reversed
+    const __m256i reverse = _mm256_setr_epi8(7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8,
+                                             7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8);
+
+    __m128i bytes = _mm_loadu_si128((const __m128i *)input);
+    __m128i high = _mm_and_si128(_mm_srli_epi16(bytes, 4), _mm_set1_epi8(15));
+    __m128i low = _mm_and_si128(bytes, _mm_set1_epi8(15));
+
+    // the nibbles in order: high and low nibble of every byte
+    __m256i nibbles = _mm256_set_m128i(_mm_unpackhi_epi8(high, low), _mm_unpacklo_epi8(high, low));
+    __m256i code = _mm256_shuffle_epi8(_mm256_shuffle_epi8(table, nibbles), reverse);
+
+    for (int i = 0; i < 7; i++) {
+        // move bit 6 - i of every codeword to the top of its byte
+        uint32_t bits = _mm256_movemask_epi8(_mm256_slli_epi16(code, i + 1));
+
+        memcpy(stripes[i] + index, &bits, 4);
+    }
+}
+#endif
+
+// encode `size` bytes of input into the stripes of `code`, like stripe():
+// every codeword (`data` bits of input) is spread over the stripes, 8 of
+// them per stripe byte. The last block of 64 codewords is padded with zeros
+// in `input`, which needs room for 8 * data + 8 more bytes. Returns the
+// number of bytes written to each stripe.
+size_t stripe_code(hamming_code *code, unsigned char *input, size_t size, unsigned char *stripes[]) {
+    size_t block = 8 * code->data;
+    size_t padded = (size + block - 1) / block * block;
+
+    memset(input + size, 0, padded - size + 8);
+
+    for (size_t i = 0; i < padded; i += block) {
+        stripe64(code, input + i, stripes, i / code->data);
+    }
+
+    return (size + code->data - 1) / code->data;
+}
+
+// stripe the 64 codewords of 8 * data input bytes into bytes `index` to
+// index + 7 of every stripe
+void stripe64(hamming_code *code, const unsigned char *input, unsigned char *stripes[], size_t index) {
+    uint64_t rows[64], words[MAX_PARTS] = { 0 };
+
+    // one codeword per row, its data bits on top; the transpose turns them
+    // into one row per data bit, the first codeword on top
+    for (int c = 0; c < 64; c++) {
+        rows[c] = get_bits(input, (size_t)c * code->data, code->data);
+    }
+
+    transpose64(rows, code->data, 0);
+
+    // bit-sliced parity: check m covers the positions with bit m set
+    for (int j = 0; j < code->data; j++) {
+        int part = code->data_parts[j];
+
+        words[part] = rows[j];
+
+        for (int m = 0; m < code->checks; m++) {
+            if ((part + 1) >> m & 1) words[(1 << m) - 1] ^= rows[j];
+        }
+    }
+
+    if (code->secded) {
+        for (int i = 0; i < code->parts - 1; i++) {
+            words[code->parts - 1] ^= words[i];
+        }
+    }
+
+    for (int i = 0; i < code->parts; i++) {
+        uint64_t word = htobe64(words[i]);
+
+        memcpy(stripes[i] + index, &word, 8);
+    }
+}
+
+// read `count` bits (1-64) of `input`, starting at bit `bit` (the top bit of
+// a byte first), into the top of a word. Reads up to 9 bytes.
+uint64_t get_bits(const unsigned char *input, size_t bit, int count) {
+    const unsigned char *bytes = input + bit / 8;
+    int shift = bit % 8;
+    uint64_t x;
+
+    memcpy(&x, bytes, 8);
+    x = be64toh(x);
+
+    if (shift) x = x << shift | bytes[8] >> (8 - shift);
+
+    return x & ~0ULL << (64 - count);
+}
+
+// RAID 5/6 encoding: cut the input into stripes of `data` blocks and write
+// the blocks and the parity of every stripe to the part files, a batch of
+// stripes at a time (encoding one while the last one is written). The last
+// stripe is padded with zeros. Returns the number of input bytes.
+uint64_t encode_blocks(FILE *input, char input_path[], block_layout *layout, int direct) {
+    size_t block = layout->block, stripe_size = layout->data * block, stripes = 1, size;
+    int parity[2] = { layout->data, layout->data + 1 };
+    unsigned char *parts[2][MAX_PARTS];
+    int current = 0;
+    uint64_t total = 0;
+    part_set set;
+
+    // a power of 2 of stripes per batch keeps the part files aligned for
+    // direct I/O
+    while (2 * stripes * stripe_size <= CHUNK_SIZE) stripes *= 2;
+
+    unsigned char *input_buffer = malloc(stripes * stripe_size);
+
+    for (int i = 0; i < layout->parts; i++) {
+        parts[0][i] = alloc_buffer(stripes * block);
+        parts[1][i] = alloc_buffer(stripes * block);
+    }
+
+    open_parts(&set, input_path, layout->parts, 1, direct, -1);
+
+    while ((size = fread(input_buffer, 1, stripes * stripe_size, input)) > 0) {
+        size_t used = (size + stripe_size - 1) / stripe_size;
+
+        total += size;
+        memset(input_buffer + size, 0, used * stripe_size - size);
+
+        for (size_t s = 0; s < used; s++) {
+            for (int i = 0; i < layout->data; i++) {
+                memcpy(parts[current][i] + s * block, input_buffer + (s * layout->data + i) * block, block);
+            }
+        }
+
+        // the parity parts are the ones to fill in
+        recover_parts(layout, parts[current], used * block, parity, layout->level - 4);
+
+        wait_parts(&set, NULL);
+        start_parts(&set, parts[current], used * block);
+        current = !current;
+    }
+
+    close_parts(&set);
+
+    for (int i = 0; i < layout->parts; i++) {
+        free(parts[0][i]);
+        free(parts[1][i]);
+    }
+    free(input_buffer);
+
+    return total;
+}
+
 // helper for accessing and validating files, exits on error
 FILE *get_file(char path[], char mode[]) {
     FILE *file = fopen(path, mode);
@@ -107,19 +567,58 @@ FILE *get_file(char path[], char mode[]) {
 
 // process the command line options (or fall back to default values):
 //      -f <path>: input file
-void get_arg_paths(int argc, char **argv, char *input_path) {
+//      -c <parts,data>: code, 7,4 (the default), 15,11, 31,26, or SECDED like
+//          8,4 and 72,64
+//      -l <level>: 2 (the default) for bits striped with a Hamming code, 5 or
+//          6 for blocks striped with parity
+//      -n <parts>: number of data parts for RAID 5/6
+//      -b <bytes>: block size for RAID 5/6, a power of 2 from 512 on
+//      -j <threads>: encode on this many threads (1-64) with pread and
+//          pwrite, through the page cache (RAID 2 only, not with -D)
+//      -D: write the part files with direct I/O (O_DIRECT), bypassing the
+//          page cache
+void get_arg_paths(int argc, char **argv, char *input_path, char *code_name, int *level, int *data, size_t *block, int *threads, int *direct) {
     int opt;
 
     // check if input/output paths are given
-    while ((opt = getopt(argc, argv, "f:")) != -1) {
+    while ((opt = getopt(argc, argv, "f:c:l:n:b:j:D")) != -1) {
 
         switch (opt) {
             case 'f':
                 strcpy(input_path, optarg);
                 break;
 
+            case 'c':
+                snprintf(code_name, 32, "%s", optarg);
+                break;
+
+            case 'l':
+                *level = atoi(optarg);
+                break;
+
+            case 'n':
+                *data = atoi(optarg);
+                break;
+
+            case 'b':
+                *block = strtoull(optarg, NULL, 10);
+                break;
+
+            case 'j':
+                *threads = atoi(optarg);
+
+                if (*threads < 1 || *threads > 64) {
+                    printf("Invalid number of threads: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+
+            case 'D':
+                *direct = 1;
+                break;
+
             default:
-                printf("Usage: %s [-f filename]\n", argv[0]);
+                printf("Usage: %s [-f filename] [-c code] [-l level] [-n parts] [-b bytes] [-j threads] [-D]\n", argv[0]);
                 exit(1);
         }
 
@@ -129,4 +628,8 @@ void get_arg_paths(int argc, char **argv, char *input_path) {
     if (input_path[0] == 0) {
         strcpy(input_path, DEFAULT_IN);
     }
+
+    if (code_name[0] == 0) {
+        strcpy(code_name, DEFAULT_CODE);
+    }
 }
@@ -0,0 +1,734 @@
+/*
+raid2.c: the Hamming codes and part file I/O shared by raid and diar (see raid2.h).
+*/
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <endian.h>
+#include <sys/stat.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#include "raid2.h"
+
+#define MANIFEST_MAGIC "RAIDMAN"
+#define MANIFEST_VERSION 1
+#define MANIFEST_HEADER_SIZE 40
+
+// CRC32C (Castagnoli) of every byte, for machines without SSE 4.2
+uint32_t crc_table[256];
+pthread_once_t crc_table_once = PTHREAD_ONCE_INIT;
+
+void *part_worker(void *arg);
+size_t transfer(part_io *part);
+void put_le(unsigned char *out, uint64_t val, int bytes);
+uint64_t get_le(const unsigned char *data, int bytes);
+void init_crc_table(void);
+uint32_t crc32c_sse42(uint32_t crc, const unsigned char *data, size_t size);
+
+// set up the code called `name` ("parts,data", e.g. "7,4"): SECDED if the
+// last part is the overall parity, otherwise a Hamming code (shortened if it
+// is below a power of 2 minus 1). Either way, the parity bits must be
+// exactly the positions that are a power of 2, so the data bits fill the
+// rest. Returns 0 if there is no such code.
+int init_code(hamming_code *code, char name[]) {
+    int parts, data;
+
+    if (sscanf(name, "%d,%d", &parts, &data) != 2) return 0;
+    if (data < 1 || data > 64 || parts <= data || parts > MAX_PARTS) return 0;
+
+    for (int secded = 1; secded >= 0; secded--) {
+        int positions = parts - secded, checks = parts - data - secded, count = 0;
+
+        if (checks < 1 || checks > MAX_CHECKS) continue;
+
+        // positions i + 1 that aren't a power of 2
+        for (int i = 0; i < positions; i++) {
+            if ((i + 1) & i) count++;
+        }
+
+        if (count != data) continue;
+
+        code->parts = parts;
+        code->data = data;
+        code->checks = checks;
+        code->secded = secded;
+
+        for (int i = 0, j = 0; i < positions; i++) {
+            if ((i + 1) & i) code->data_parts[j++] = i;
+        }
+
+        return 1;
+    }
+
+    return 0;
+}
+
+// check the parity of the 64 codewords in `words` (one word per part) and
+// flip the bits the syndromes point at: the data bits, and with
+// `parity_bits`, the parity bits as well. SECDED codewords whose checks fail
+// while their overall parity holds have two errors, and syndromes past the
+// end of a shortened code point nowhere: those are left alone and counted
+// in `failed`. Returns the mask of corrected codewords.
+uint64_t correct_code(hamming_code *code, uint64_t words[], int parity_bits, uint64_t *failed) {
+    uint64_t syndromes[MAX_CHECKS + 1] = { 0 }, any = 0, parity = 0;
+    int positions = code->parts - code->secded;
+
+    /* error detection */
+
+    for (int i = 0; i < positions; i++) {
+        for (int m = 0; m < code->checks; m++) {
+            if ((i + 1) >> m & 1) syndromes[m] ^= words[i];
+        }
+    }
+
+    for (int m = 0; m < code->checks; m++) {
+        any |= syndromes[m];
+    }
+
+    if (code->secded) {
+        for (int i = 0; i < code->parts; i++) {
+            parity ^= words[i];
+        }
+    }
+
+    if ((any | parity) == 0) return 0;
+
+    /* error correction */
+
+    // the codewords a single error explains, and the ones the syndromes
+    // point at
+    uint64_t single = code->secded ? parity : ~0ULL, located = 0;
+
+    for (int i = 0; i < positions; i++) {
+        uint64_t mask = ~0ULL;
+
+        for (int m = 0; m < code->checks; m++) {
+            mask &= (i + 1) >> m & 1 ? syndromes[m] : ~syndromes[m];
+        }
+
+        located |= mask;
+
+        if (parity_bits || (i + 1) & i) words[i] ^= mask & single;
+    }
+
+    // an error in the overall parity bit leaves the checks alone
+    if (parity_bits && code->secded) words[code->parts - 1] ^= parity & ~any;
+
+    uint64_t uncorrectable = any & ~(located & single);
+
+    *failed += __builtin_popcountll(uncorrectable);
+
+    return (any | parity) & ~uncorrectable;
+}
+
+// fill in word `missing` of the 64 codewords in `words` from the others.
+// With the lost bits at 0, the checks of a codeword either all pass or
+// spell out the lost position (when its bit was 1), so any check that
+// covers that position gives the lost word; with SECDED, so does the
+// overall parity.
+void fill_erasure(hamming_code *code, uint64_t words[], int missing) {
+    int check = __builtin_ctz(missing + 1);
+    uint64_t word = 0;
+
+    for (int i = 0; i < code->parts; i++) {
+        if (i != missing && (code->secded || (i + 1) >> check & 1)) word ^= words[i];
+    }
+
+    words[missing] = word;
+}
+
+// decode `length` bytes of the original file (`size` bytes long) from
+// `offset` on into `output`, reading only the words of the part files `fds`
+// that hold them with pread: byte k of the file is in word k / (8 * data)
+// of every part. One part may be missing (fd -1) and is filled in from the
+// others. Codewords that couldn't be corrected are counted in `failed`.
+// `scratch` (RANGE_SCRATCH_SIZE bytes) is the caller's, so a loop of calls
+// allocates nothing. Returns the number of bytes decoded, short at the end
+// of the file.
+size_t read_range(hamming_code *code, int fds[], uint64_t size, uint64_t offset, size_t length, unsigned char *output, unsigned char *scratch, uint64_t *failed) {
+    size_t word_bytes = 8 * code->data;
+    unsigned char *parts = scratch, *decoded = scratch + code->parts * RANGE_STRIPE;
+    int missing = -1;
+
+    for (int j = 0; j < code->parts; j++) {
+        if (fds[j] < 0) missing = j;
+    }
+
+    if (offset > size) offset = size;
+    if (length > size - offset) length = size - offset;
+
+    for (size_t done = 0; done < length; ) {
+        uint64_t first = (offset + done) / word_bytes;
+        size_t skip = offset + done - first * word_bytes;
+        size_t count = (skip + length - done + word_bytes - 1) / word_bytes;
+
+        if (count > RANGE_STRIPE / 8) count = RANGE_STRIPE / 8;
+
+        // a short part file reads as zeros
+        for (int j = 0; j < code->parts; j++) {
+            unsigned char *part = parts + j * RANGE_STRIPE;
+            size_t got = read_part(fds[j], part, 8 * count, 8 * first);
+
+            memset(part + got, 0, 8 * count - got);
+        }
+
+        for (size_t w = 0; w < count; w++) {
+            uint64_t words[MAX_PARTS], rows[64] = { 0 };
+
+            for (int j = 0; j < code->parts; j++) {
+                memcpy(&words[j], parts + j * RANGE_STRIPE + 8 * w, 8);
+            }
+
+            if (missing >= 0) {
+                fill_erasure(code, words, missing);
+            } else {
+                correct_code(code, words, 0, failed);
+            }
+
+            for (int j = 0; j < code->data; j++) {
+                rows[j] = be64toh(words[code->data_parts[j]]);
+            }
+
+            transpose64(rows, code->data, 1);
+            put_bits(rows, code->data, decoded + w * word_bytes);
+        }
+
+        size_t n = count * word_bytes - skip;
+
+        if (n > length - done) n = length - done;
+
+        memcpy(output + done, decoded + skip, n);
+        done += n;
+    }
+
+    return length;
+}
+
+// open the part files `basename`.part0 to part<count - 1> for reading or
+// writing (created or truncated) and start their threads. With `direct`, the files bypass the
+// page cache (O_DIRECT) where the file system allows it. Part `missing` (if
+// not -1) is left out, and when reading, so are the parts that don't exist
+// (the caller checks `lost` against what it can do without).
+void open_parts(part_set *set, char basename[], int count, int write, int direct, int missing) {
+    char path[256] = { 0 };
+    int flags = write ? O_WRONLY | O_CREAT | O_TRUNC : O_RDONLY;
+
+    set->count = count;
+    set->write = write;
+    set->direct = direct;
+    set->missing = missing;
+    set->lost = missing >= 0;
+    set->offset = 0;
+    set->pending = 0;
+    set->quit = 0;
+
+    pthread_mutex_init(&set->lock, NULL);
+    pthread_cond_init(&set->work, NULL);
+    pthread_cond_init(&set->finished, NULL);
+
+    for (int i = 0; i < set->count; i++) {
+        part_io *part = &set->parts[i];
+
+        snprintf(path, sizeof(path), "%s.part%d", basename, i);
+
+        part->fd = -1;
+        part->set = set;
+        part->index = i;
+        part->pending = 0;
+
+        if (i == missing) {
+            pthread_create(&part->thread, NULL, part_worker, part);
+            continue;
+        }
+
+        if (direct) {
+            part->fd = open(path, flags | O_DIRECT, 0644);
+
+            // tmpfs and some others don't do direct I/O
+            if (part->fd < 0 && errno == EINVAL) {
+                printf("No direct I/O for %s, using the page cache\n", path);
+            }
+        }
+
+        if (part->fd < 0) part->fd = open(path, flags, 0644);
+
+        if (part->fd < 0 && !write && errno == ENOENT) {
+            if (set->missing < 0) set->missing = i;
+            set->lost++;
+        } else if (part->fd < 0) {
+            printf("Failed to open file: %s\n", path);
+            exit(1);
+        }
+
+        pthread_create(&part->thread, NULL, part_worker, part);
+    }
+}
+
+// open the part files `basename`.part0 to part<count - 1> with open()
+// `flags`, for read_part() and write_part() at offsets of the caller's
+// choosing. Unless they are being created, the parts that don't exist are
+// left out (fd -1); returns how many.
+int open_part_files(int fds[], char basename[], int count, int flags) {
+    char path[256] = { 0 };
+    int lost = 0;
+
+    for (int i = 0; i < count; i++) {
+        snprintf(path, sizeof(path), "%s.part%d", basename, i);
+        fds[i] = open(path, flags, 0644);
+
+        if (fds[i] < 0 && !(flags & O_CREAT) && errno == ENOENT) {
+            lost++;
+        } else if (fds[i] < 0) {
+            printf("Failed to open file: %s\n", path);
+            exit(1);
+        }
+    }
+
+    return lost;
+}
+
+// read up to `size` bytes of a part file at `offset`, exits on error.
+// Returns the number of bytes read, short at the end of the file (a part
+// left out, fd -1, has none).
+size_t read_part(int fd, unsigned char *buffer, size_t size, uint64_t offset) {
+    size_t done = 0;
+
+    if (fd < 0) return 0;
+
+    while (done < size) {
+        ssize_t n = pread(fd, buffer + done, size - done, offset + done);
+
+        if (n < 0 && errno == EINTR) continue;
+
+        if (n < 0) {
+            printf("Failed to read part file\n");
+            exit(1);
+        }
+
+        if (n == 0) break;
+
+        done += n;
+    }
+
+    return done;
+}
+
+// write `size` bytes to a part file at `offset`, exits on error
+void write_part(int fd, unsigned char *buffer, size_t size, uint64_t offset) {
+    size_t done = 0;
+
+    while (done < size) {
+        ssize_t n = pwrite(fd, buffer + done, size - done, offset + done);
+
+        if (n < 0 && errno == EINTR) continue;
+
+        if (n <= 0) {
+            printf("Failed to write part file\n");
+            exit(1);
+        }
+
+        done += n;
+    }
+}
+
+// have every part thread transfer `size` bytes between its file (at the
+// current offset of the set) and buffers[i]. Buffers must come from
+// alloc_buffer() with room for `size` rounded up to IO_ALIGN.
+void start_parts(part_set *set, unsigned char *buffers[], size_t size) {
+    pthread_mutex_lock(&set->lock);
+
+    for (int i = 0; i < set->count; i++) {
+        part_io *part = &set->parts[i];
+
+        part->buffer = buffers[i];
+        part->size = size;
+        part->offset = set->offset;
+        part->done = 0;
+        part->pending = 1;
+    }
+
+    set->pending = set->count;
+    set->offset += size;
+
+    pthread_cond_broadcast(&set->work);
+    pthread_mutex_unlock(&set->lock);
+}
+
+// wait for the transfers started last, and store the number of bytes each
+// part transferred in done[] (if not NULL). Reads stop short at the end of
+// a file.
+void wait_parts(part_set *set, size_t done[]) {
+    pthread_mutex_lock(&set->lock);
+
+    while (set->pending > 0) {
+        pthread_cond_wait(&set->finished, &set->lock);
+    }
+
+    pthread_mutex_unlock(&set->lock);
+
+    if (done) {
+        for (int i = 0; i < set->count; i++) {
+            done[i] = set->parts[i].done;
+        }
+    }
+}
+
+// wait for any transfers, stop the threads and close the files
+void close_parts(part_set *set) {
+    wait_parts(set, NULL);
+
+    pthread_mutex_lock(&set->lock);
+    set->quit = 1;
+    pthread_cond_broadcast(&set->work);
+    pthread_mutex_unlock(&set->lock);
+
+    for (int i = 0; i < set->count; i++) {
+        pthread_join(set->parts[i].thread, NULL);
+        if (set->parts[i].fd >= 0) close(set->parts[i].fd);
+    }
+
+    pthread_mutex_destroy(&set->lock);
+    pthread_cond_destroy(&set->work);
+    pthread_cond_destroy(&set->finished);
+}
+
+// thread of one part file: carry out its jobs until the set is closed
+void *part_worker(void *arg) {
+    part_io *part = arg;
+    part_set *set = part->set;
+
+    pthread_mutex_lock(&set->lock);
+
+    while (1) {
+        if (!part->pending) {
+            if (set->quit) break;
+
+            pthread_cond_wait(&set->work, &set->lock);
+            continue;
+        }
+
+        pthread_mutex_unlock(&set->lock);
+        size_t done = transfer(part);
+        pthread_mutex_lock(&set->lock);
+
+        part->done = done;
+        part->pending = 0;
+
+        if (--set->pending == 0) pthread_cond_broadcast(&set->finished);
+    }
+
+    pthread_mutex_unlock(&set->lock);
+
+    return NULL;
+}
+
+// carry out the job of `part`, exits on error. Returns the number of bytes
+// transferred.
+size_t transfer(part_io *part) {
+    part_set *set = part->set;
+    size_t size = part->size, done = 0;
+
+    // a missing part has no data
+    if (part->fd < 0) return 0;
+
+    // direct I/O moves whole aligned blocks: a read may go past the end of
+    // the job (the buffer has room), the unaligned tail of a write goes
+    // through the page cache
+    if (set->direct && size % IO_ALIGN != 0) {
+        if (!set->write) {
+            size = (size + IO_ALIGN - 1) / IO_ALIGN * IO_ALIGN;
+        } else if (size < IO_ALIGN) {
+            fcntl(part->fd, F_SETFL, fcntl(part->fd, F_GETFL) & ~O_DIRECT);
+        } else {
+            size -= size % IO_ALIGN;
+        }
+    }
+
+    while (done < part->size) {
+        ssize_t n;
+
+        if (set->write) {
+            n = pwrite(part->fd, part->buffer + done, size - done, part->offset + done);
+        } else {
+            n = pread(part->fd, part->buffer + done, size - done, part->offset + done);
+        }
+
+        if (n < 0 && errno == EINTR) continue;
+
+        if (n < 0) {
+            printf("Failed to %s part %d\n", set->write ? "write" : "read", part->index);
+            exit(1);
+        }
+
+        // end of file
+        if (n == 0) break;
+
+        done += n;
+
+        // the aligned part of a direct write is done, the rest goes through
+        // the page cache
+        if (done == size && size < part->size) {
+            fcntl(part->fd, F_SETFL, fcntl(part->fd, F_GETFL) & ~O_DIRECT);
+            size = part->size;
+        }
+    }
+
+    return done < part->size ? done : part->size;
+}
+
+// write `m` to `basename`.manifest: the magic and version, the level, parts,
+// data and block size (32 bits each), the size and number of blocks (64
+// bits each), the CRCs, and a CRC of all that, little-endian. Exits on
+// error.
+void write_manifest(char basename[], manifest *m) {
+    char path[256] = { 0 };
+    size_t length = MANIFEST_HEADER_SIZE + 4 * m->blocks;
+    unsigned char *buffer = malloc(length + 4);
+
+    memcpy(buffer, MANIFEST_MAGIC, 7);
+    buffer[7] = MANIFEST_VERSION;
+    put_le(buffer + 8, m->level, 4);
+    put_le(buffer + 12, m->parts, 4);
+    put_le(buffer + 16, m->data, 4);
+    put_le(buffer + 20, m->block_size, 4);
+    put_le(buffer + 24, m->size, 8);
+    put_le(buffer + 32, m->blocks, 8);
+
+    for (uint64_t b = 0; b < m->blocks; b++) {
+        put_le(buffer + MANIFEST_HEADER_SIZE + 4 * b, m->crcs[b], 4);
+    }
+
+    put_le(buffer + length, crc32c(0, buffer, length), 4);
+
+    snprintf(path, sizeof(path), "%s.manifest", basename);
+    FILE *file = fopen(path, "w");
+
+    if (file == NULL || fwrite(buffer, 1, length + 4, file) != length + 4 || fclose(file) != 0) {
+        printf("Failed to write file: %s\n", path);
+        exit(1);
+    }
+
+    free(buffer);
+}
+
+// read `basename`.manifest into `m` (allocating its CRCs). Returns 0 if
+// there is none, exits if it is damaged or of another version.
+int read_manifest(char basename[], manifest *m) {
+    char path[256] = { 0 };
+    unsigned char header[MANIFEST_HEADER_SIZE], *crcs = NULL;
+
+    snprintf(path, sizeof(path), "%s.manifest", basename);
+    FILE *file = fopen(path, "r");
+
+    if (file == NULL) return 0;
+
+    int valid = fread(header, 1, MANIFEST_HEADER_SIZE, file) == MANIFEST_HEADER_SIZE &&
+                memcmp(header, MANIFEST_MAGIC, 7) == 0;
+
+    if (valid && header[7] != MANIFEST_VERSION) {
+        printf("Unsupported manifest version %d: %s\n", header[7], path);
+        exit(1);
+    }
+
+    if (valid) {
+        m->level = get_le(header + 8, 4);
+        m->parts = get_le(header + 12, 4);
+        m->data = get_le(header + 16, 4);
+        m->block_size = get_le(header + 20, 4);
+        m->size = get_le(header + 24, 8);
+        m->blocks = get_le(header + 32, 8);
+
+        // only RAID 2 has CRCs, one for every block of the file
+        uint64_t blocks = m->level == 2 && m->block_size > 0 ? (m->size + m->block_size - 1) / m->block_size : 0;
+
+        valid = m->blocks == blocks;
+    }
+
+    // the CRCs and the CRC of the manifest have to be what is left of the
+    // file, before anything is allocated for them
+    if (valid) {
+        struct stat st;
+        uint64_t left = fstat(fileno(file), &st) == 0 && st.st_size >= MANIFEST_HEADER_SIZE ? st.st_size - MANIFEST_HEADER_SIZE : 0;
+
+        valid = left >= 4 && left % 4 == 0 && (left - 4) / 4 == m->blocks;
+    }
+
+    if (valid) {
+        crcs = malloc(4 * m->blocks + 4);
+        m->crcs = malloc(4 * m->blocks + 1);
+
+        valid = crcs != NULL && m->crcs != NULL && fread(crcs, 4, m->blocks + 1, file) == m->blocks + 1 &&
+                crc32c(crc32c(0, header, MANIFEST_HEADER_SIZE), crcs, 4 * m->blocks) == get_le(crcs + 4 * m->blocks, 4);
+    }
+
+    if (!valid) {
+        printf("Damaged manifest: %s\n", path);
+        exit(1);
+    }
+
+    for (uint64_t b = 0; b < m->blocks; b++) {
+        m->crcs[b] = get_le(crcs + 4 * b, 4);
+    }
+
+    fclose(file);
+    free(crcs);
+
+    return 1;
+}
+
+// helpers for little-endian manifest fields
+void put_le(unsigned char *out, uint64_t val, int bytes) {
+    for (int i = 0; i < bytes; i++) {
+        out[i] = val >> (8 * i);
+    }
+}
+
+uint64_t get_le(const unsigned char *data, int bytes) {
+    uint64_t val = 0;
+
+    for (int i = 0; i < bytes; i++) {
+        val |= (uint64_t)data[i] << (8 * i);
+    }
+
+    return val;
+}
+
+// update `crc` (0 to start) with the CRC32C of `size` bytes of `data`
+uint32_t crc32c(uint32_t crc, const unsigned char *data, size_t size) {
+    crc = ~crc;
+
+#if defined(__x86_64__) || defined(__i386__)
+    if (__builtin_cpu_supports("sse4.2")) return ~crc32c_sse42(crc, data, size);
+#endif
+
+    pthread_once(&crc_table_once, init_crc_table);
+
+    for (size_t i = 0; i < size; i++) {
+        crc = crc >> 8 ^ crc_table[(crc ^ data[i]) & 0xff];
+    }
+
+    return ~crc;
+}
+
+// fill the CRC32C table (the polynomial 0x1EDC6F41, bits reversed)
+void init_crc_table(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+
+        for (int k = 0; k < 8; k++) {
+            crc = crc >> 1 ^ (crc & 1 ? 0x82F63B78 : 0);
+        }
+
+        crc_table[i] = crc;
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// CRC32C with the SSE 4.2 instruction, 8 bytes at a time
+__attribute__((target("sse4.2")))
+uint32_t crc32c_sse42(uint32_t crc, const unsigned char *data, size_t size) {
+    size_t i = 0;
+
+#if defined(__x86_64__)
+    uint64_t crc64 = crc;
+
+    for (; size - i >= 8; i += 8) {
+        uint64_t word;
+
+        memcpy(&word, data + i, 8);
+        crc64 = _mm_crc32_u64(crc64, word);
+    }
+
+    crc = crc64;
+#endif
+
+    for (; i < size; i++) {
+        crc = _mm_crc32_u8(crc, data[i]);
+    }
+
+    return crc;
+}
+#endif
+
+// allocate an I/O buffer of `size` bytes (rounded up to IO_ALIGN), exits
+// if out of memory
+unsigned char *alloc_buffer(size_t size) {
+    void *buffer;
+
+    if (posix_memalign(&buffer, IO_ALIGN, (size + IO_ALIGN - 1) / IO_ALIGN * IO_ALIGN) != 0) {
+        printf("Out of memory\n");
+        exit(1);
+    }
+
+    return buffer;
+}
+
+// transpose the 8x8 bit matrix in `x`, row r being byte 7 - r and column c
+// bit 7 - c of that byte (Hacker's Delight, section 7-3)
+uint64_t transpose8(uint64_t x) {
+    uint64_t t;
+
+    t = (x ^ (x >> 7)) & 0x00AA00AA00AA00AAULL;
+    x = x ^ t ^ (t << 7);
+    t = (x ^ (x >> 14)) & 0x0000CCCC0000CCCCULL;
+    x = x ^ t ^ (t << 14);
+    t = (x ^ (x >> 28)) & 0x00000000F0F0F0F0ULL;
+    x = x ^ t ^ (t << 28);
+
+    return x;
+}
+
+// transpose the 64x64 bit matrix in `rows`, row r being rows[r] and column
+// c bit 63 - c of it (Hacker's Delight, section 7-3, for 64 bits), where
+// only the first `count` rows of the input are set (the rest are 0) or only
+// the first `count` rows of the result are needed. Every step swaps the
+// off-diagonal j x j blocks of 2j x 2j blocks, exchanging bit j of the row
+// and column numbers; the steps commute, so they are taken in the order
+// that lets blocks without set or needed rows be skipped.
+void transpose64(uint64_t rows[64], int count, int input) {
+    for (int step = 0; step < 6; step++) {
+        int j = input ? 1 << step : 32 >> step;
+        uint64_t mask = ~0ULL / ((1ULL << j) + 1);
+
+        // the blocks up to the first one without set (needed) rows
+        int limit = input ? (count + j - 1) / j * j : (count + 2 * j - 1) / (2 * j) * (2 * j);
+
+        if (limit > 64) limit = 64;
+
+        for (int b = 0; b < limit; b += 2 * j) {
+            for (int k = b; k < b + j; k++) {
+                uint64_t t = (rows[k] ^ (rows[k + j] >> j)) & mask;
+
+                rows[k] ^= t;
+                rows[k + j] ^= t << j;
+            }
+        }
+    }
+}
+
+// write the data bits of 64 codewords (`count` bits on top of each row) to
+// `output`, one codeword after the other
+void put_bits(uint64_t rows[64], int count, unsigned char *output) {
+    uint64_t bits = 0;
+    int used = 0;
+
+    for (int c = 0; c < 64; c++) {
+        bits |= rows[c] >> used;
+        used += count;
+
+        if (used >= 64) {
+            uint64_t word = htobe64(bits);
+
+            memcpy(output, &word, 8);
+            output += 8;
+            used -= 64;
+            bits = used ? rows[c] << (count - used) : 0;
+        }
+    }
+}
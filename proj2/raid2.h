@@ -0,0 +1,115 @@
+/*
+raid2.h: the Hamming codes and part file I/O shared by raid and diar.
+
+Every bit of a codeword goes to its own part file. The part files of a set are
+read and written in large chunks, each by its own thread, so all drives transfer
+at once.
+*/
+#ifndef RAID2_H
+#define RAID2_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+// enough for SECDED(72,64), whose 7 checks tell apart 127 positions
+#define MAX_PARTS 72
+#define MAX_CHECKS 7
+
+// bytes of every part file read_range() works on at a time, and the scratch
+// it needs: a stripe of every part, and the data bits decoded from them
+#define RANGE_STRIPE 4096
+#define RANGE_SCRATCH_SIZE (2 * MAX_PARTS * RANGE_STRIPE)
+
+// a Hamming code with `parts` bits per codeword, `data` of them data bits,
+// and `checks` parity checks. Part file i holds bit position i + 1 of every
+// codeword: the parity bits are at the powers of 2 and the data bits, in
+// order, fill the rest. A SECDED code adds a bit for the parity of the whole
+// codeword, in the last part file, so double errors are detected instead of
+// miscorrected.
+struct hamming_code {
+    int parts;
+    int data;
+    int checks;
+    int secded;
+
+    // part file of every data bit
+    int data_parts[64];
+} typedef hamming_code;
+
+// buffers are aligned (and O_DIRECT transfers sized) to this many bytes
+#define IO_ALIGN 4096
+
+// every CRC in a manifest covers the input behind this many bytes of every
+// part file (chunks are made of whole blocks)
+#define CRC_STRIPE 4096
+
+// what raid knows about a set of part files, kept in `basename`.manifest:
+// the RAID level, the code (parts, data) or RAID 5/6 layout (data parts,
+// block_size), the length of the original file, and for RAID 2, the CRC32C
+// of every block of block_size bytes of it
+struct manifest {
+    int level;
+    int parts, data;
+    size_t block_size;
+    uint64_t size;
+    uint64_t blocks;
+    uint32_t *crcs;
+} typedef manifest;
+
+// one part file and the job its thread is working on
+struct part_io {
+    struct part_set *set;
+    int index;
+    int fd;
+    pthread_t thread;
+
+    unsigned char *buffer;
+    size_t size;
+    uint64_t offset;
+    size_t done;
+    int pending;
+} typedef part_io;
+
+// the `count` part files of a set, all reading or all writing. A set being
+// read can do without some of its parts, which then read as empty: `lost`
+// of them, the first one being `missing` (-1 if there is none).
+struct part_set {
+    part_io parts[MAX_PARTS];
+    int count;
+    int write;
+    int direct;
+    int missing;
+    int lost;
+    uint64_t offset;
+
+    pthread_mutex_t lock;
+    pthread_cond_t work, finished;
+    int pending;
+    int quit;
+} typedef part_set;
+
+int init_code(hamming_code *code, char name[]);
+uint64_t correct_code(hamming_code *code, uint64_t words[], int parity_bits, uint64_t *failed);
+void fill_erasure(hamming_code *code, uint64_t words[], int missing);
+size_t read_range(hamming_code *code, int fds[], uint64_t size, uint64_t offset, size_t length, unsigned char *output, unsigned char *scratch, uint64_t *failed);
+
+void open_parts(part_set *set, char basename[], int count, int write, int direct, int missing);
+void start_parts(part_set *set, unsigned char *buffers[], size_t size);
+void wait_parts(part_set *set, size_t done[]);
+void close_parts(part_set *set);
+
+int open_part_files(int fds[], char basename[], int count, int flags);
+size_t read_part(int fd, unsigned char *buffer, size_t size, uint64_t offset);
+void write_part(int fd, unsigned char *buffer, size_t size, uint64_t offset);
+
+void write_manifest(char basename[], manifest *m);
+int read_manifest(char basename[], manifest *m);
+uint32_t crc32c(uint32_t crc, const unsigned char *data, size_t size);
+
+unsigned char *alloc_buffer(size_t size);
+uint64_t transpose8(uint64_t x);
+void transpose64(uint64_t rows[64], int count, int input);
+void put_bits(uint64_t rows[64], int count, unsigned char *output);
+
+#endif
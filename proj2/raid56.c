@@ -0,0 +1,291 @@
+/*
+raid56.c: block-striped RAID 5 and RAID 6 parity (see raid56.h).
+The parity is worked out a slice of every part at a time, so the partial sums stay
+in L1, with AVX2 kernels for XOR and GF(2^8) multiplication where available (the
+multiply looks both nibbles of every byte up in 16-entry tables with byte shuffles).
+*/
+#include <string.h>
+#include <stdint.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#include "raid2.h"
+#include "raid56.h"
+
+// bytes of every part worked on at a time
+#define SLICE 4096
+
+// GF(2^8) powers and logarithms of the generator 2 (the powers twice over,
+// so sums of logarithms need no reduction)
+unsigned char gf_exp[512], gf_log[256];
+int use_avx2;
+
+void init_gf(void);
+unsigned char gf_mul(unsigned char a, unsigned char b);
+
+void xor_region(unsigned char *dst, const unsigned char *src, size_t size);
+void mul2_region(unsigned char *dst, const unsigned char *src, size_t size);
+void mul_region(unsigned char *dst, const unsigned char *src, unsigned char c, size_t size);
+size_t xor_avx2(unsigned char *dst, const unsigned char *src, size_t size);
+size_t mul2_avx2(unsigned char *dst, const unsigned char *src, size_t size);
+size_t mul_avx2(unsigned char *dst, const unsigned char *src, unsigned char low[16], unsigned char high[16], size_t size);
+
+// set up `layout` for RAID `level` (5 or 6) with `data` data parts and
+// blocks of `block` bytes (a power of 2, at least 512). Returns 0 if that
+// isn't a valid layout.
+int init_layout(block_layout *layout, int level, int data, size_t block) {
+    if (level != 5 && level != 6) return 0;
+    if (data < 1 || data + level - 4 > MAX_PARTS) return 0;
+    if (block < 512 || block > (1 << 24) || (block & (block - 1)) != 0) return 0;
+
+    layout->level = level;
+    layout->data = data;
+    layout->parts = data + level - 4;
+    layout->block = block;
+
+    init_gf();
+
+#if defined(__x86_64__) || defined(__i386__)
+    use_avx2 = __builtin_cpu_supports("avx2");
+#endif
+
+    return 1;
+}
+
+// fill the GF(2^8) tables
+void init_gf(void) {
+    int x = 1;
+
+    for (int i = 0; i < 255; i++) {
+        gf_exp[i] = gf_exp[i + 255] = x;
+        gf_log[x] = i;
+
+        x <<= 1;
+        if (x & 0x100) x ^= 0x11d;
+    }
+}
+
+// product of a and b in GF(2^8)
+unsigned char gf_mul(unsigned char a, unsigned char b) {
+    if (a == 0 || b == 0) return 0;
+
+    return gf_exp[gf_log[a] + gf_log[b]];
+}
+
+// fill in the `count` parts listed in `lost` (no more than there are parity
+// parts) from the others; `size` bytes of every part, which may span several
+// stripes. Encoding is recovering the parity parts.
+void recover_parts(block_layout *layout, unsigned char *parts[], size_t size, int lost[], int count) {
+    unsigned char psum[SLICE] __attribute__((aligned(32)));
+    unsigned char qsum[SLICE] __attribute__((aligned(32)));
+    int data = layout->data, x = -1, y = -1, lost_p = 0, lost_q = 0;
+    unsigned char *p = parts[data], *q = layout->level == 6 ? parts[data + 1] : NULL;
+
+    // lost data blocks x < y, and lost parity
+    for (int i = 0; i < count; i++) {
+        if (lost[i] == data) {
+            lost_p = 1;
+        } else if (lost[i] == data + 1) {
+            lost_q = 1;
+        } else if (x < 0 || lost[i] < x) {
+            y = x;
+            x = lost[i];
+        } else {
+            y = lost[i];
+        }
+    }
+
+    // the factors of P + Pxy and Q + Qxy that give Dx when two data blocks are
+    // lost (H. Peter Anvin, "The mathematics of RAID-6"), and g^-x
+    unsigned char a = 0, b = 0, inverse = x >= 0 ? gf_exp[255 - x] : 0;
+
+    if (y >= 0) {
+        // 1 / (g^(y - x) + 1), which exists as y - x < 255
+        unsigned char denominator = gf_exp[255 - gf_log[gf_exp[y - x] ^ 1]];
+
+        a = gf_mul(gf_exp[y - x], denominator);
+        b = gf_mul(inverse, denominator);
+    }
+
+    for (size_t offset = 0; offset < size; offset += SLICE) {
+        size_t n = size - offset < SLICE ? size - offset : SLICE;
+        unsigned char *dx = x >= 0 ? parts[x] + offset : NULL;
+
+        // P and Q of the data blocks that are there
+        memset(psum, 0, n);
+
+        for (int i = 0; i < data; i++) {
+            if (i != x && i != y) xor_region(psum, parts[i] + offset, n);
+        }
+
+        if (q) {
+            memset(qsum, 0, n);
+
+            for (int i = data - 1; i >= 0; i--) {
+                mul2_region(qsum, i != x && i != y ? parts[i] + offset : NULL, n);
+            }
+        }
+
+        /* data */
+
+        if (y >= 0) {
+            // Dx + Dy and g^x Dx + g^y Dy
+            xor_region(psum, p + offset, n);
+            xor_region(qsum, q + offset, n);
+
+            memset(dx, 0, n);
+            mul_region(dx, psum, a, n);
+            mul_region(dx, qsum, b, n);
+
+            memcpy(parts[y] + offset, psum, n);
+            xor_region(parts[y] + offset, dx, n);
+        } else if (x >= 0 && !lost_p) {
+            memcpy(dx, p + offset, n);
+            xor_region(dx, psum, n);
+        } else if (x >= 0) {
+            // g^x Dx
+            xor_region(qsum, q + offset, n);
+
+            memset(dx, 0, n);
+            mul_region(dx, qsum, inverse, n);
+        }
+
+        /* parity */
+
+        if (lost_p) {
+            memcpy(p + offset, psum, n);
+            if (dx) xor_region(p + offset, dx, n);
+        }
+
+        if (lost_q) {
+            memcpy(q + offset, qsum, n);
+            if (dx) mul_region(q + offset, dx, gf_exp[x], n);
+        }
+    }
+}
+
+// dst ^= src
+void xor_region(unsigned char *dst, const unsigned char *src, size_t size) {
+    size_t i = 0;
+
+#if defined(__x86_64__) || defined(__i386__)
+    if (use_avx2) i = xor_avx2(dst, src, size);
+#endif
+
+    for (; size - i >= 8; i += 8) {
+        uint64_t a, b;
+
+        memcpy(&a, dst + i, 8);
+        memcpy(&b, src + i, 8);
+        a ^= b;
+        memcpy(dst + i, &a, 8);
+    }
+
+    for (; i < size; i++) {
+        dst[i] ^= src[i];
+    }
+}
+
+// dst = 2 * dst + src in GF(2^8) (Horner's rule for Q), src may be NULL
+void mul2_region(unsigned char *dst, const unsigned char *src, size_t size) {
+    size_t i = 0;
+
+#if defined(__x86_64__) || defined(__i386__)
+    if (use_avx2) i = mul2_avx2(dst, src, size);
+#endif
+
+    // 8 bytes at once: shift each left and reduce the ones that overflow
+    for (; size - i >= 8; i += 8) {
+        uint64_t a, b = 0, high;
+
+        memcpy(&a, dst + i, 8);
+        if (src) memcpy(&b, src + i, 8);
+
+        high = a & 0x8080808080808080ULL;
+        a = ((a ^ high) << 1) ^ (high >> 7) * 0x1d ^ b;
+        memcpy(dst + i, &a, 8);
+    }
+
+    for (; i < size; i++) {
+        dst[i] = (dst[i] << 1) ^ (dst[i] & 0x80 ? 0x1d : 0) ^ (src ? src[i] : 0);
+    }
+}
+
+// dst ^= c * src in GF(2^8)
+void mul_region(unsigned char *dst, const unsigned char *src, unsigned char c, size_t size) {
+    unsigned char low[16], high[16];
+    size_t i = 0;
+
+    // a product is the sum of the products of both nibbles
+    for (int k = 0; k < 16; k++) {
+        low[k] = gf_mul(c, k);
+        high[k] = gf_mul(c, k << 4);
+    }
+
+#if defined(__x86_64__) || defined(__i386__)
+    if (use_avx2) i = mul_avx2(dst, src, low, high, size);
+#endif
+
+    for (; i < size; i++) {
+        dst[i] ^= low[src[i] & 15] ^ high[src[i] >> 4];
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// AVX2 versions of the kernels above for 32 bytes at a time, returning how
+// many bytes they did
+
+__attribute__((target("avx2")))
+size_t xor_avx2(unsigned char *dst, const unsigned char *src, size_t size) {
+    size_t i = 0;
+
+    for (; size - i >= 32; i += 32) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(dst + i));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(src + i));
+
+        _mm256_storeu_si256((__m256i *)(dst + i), _mm256_xor_si256(a, b));
+    }
+
+    return i;
+}
+
+__attribute__((target("avx2")))
+size_t mul2_avx2(unsigned char *dst, const unsigned char *src, size_t size) {
+    const __m256i poly = _mm256_set1_epi8(0x1d);
+    size_t i = 0;
+
+    for (; size - i >= 32; i += 32) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(dst + i));
+
+        // bytes with the top bit set compare below 0
+        __m256i reduce = _mm256_and_si256(_mm256_cmpgt_epi8(_mm256_setzero_si256(), a), poly);
+
+        a = _mm256_xor_si256(_mm256_add_epi8(a, a), reduce);
+        if (src) a = _mm256_xor_si256(a, _mm256_loadu_si256((const __m256i *)(src + i)));
+
+        _mm256_storeu_si256((__m256i *)(dst + i), a);
+    }
+
+    return i;
+}
+
+__attribute__((target("avx2")))
+size_t mul_avx2(unsigned char *dst, const unsigned char *src, unsigned char low[16], unsigned char high[16], size_t size) {
+    const __m256i low_table = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)low));
+    const __m256i high_table = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)high));
+    const __m256i nibble = _mm256_set1_epi8(15);
+    size_t i = 0;
+
+    for (; size - i >= 32; i += 32) {
+        __m256i s = _mm256_loadu_si256((const __m256i *)(src + i));
+        __m256i l = _mm256_shuffle_epi8(low_table, _mm256_and_si256(s, nibble));
+        __m256i h = _mm256_shuffle_epi8(high_table, _mm256_and_si256(_mm256_srli_epi16(s, 4), nibble));
+        __m256i d = _mm256_loadu_si256((const __m256i *)(dst + i));
+
+        _mm256_storeu_si256((__m256i *)(dst + i), _mm256_xor_si256(d, _mm256_xor_si256(l, h)));
+    }
+
+    return i;
+}
+#endif
@@ -0,0 +1,25 @@
+/*
+raid56.h: block-striped RAID 5 and RAID 6 parity, shared by raid and diar.
+
+The input is cut into blocks, and every stripe of `data` blocks goes to the data
+part files 0 to data - 1, block i of a stripe to part i. Part `data` holds P, the
+XOR of the stripe. For RAID 6, part data + 1 holds Q, the sum of g^i * D_i over
+GF(2^8) (g = 2, polynomial 0x11d), so any two lost parts can be rebuilt. Parity is
+not rotated between the parts: parts `data` and up only ever hold parity.
+*/
+#ifndef RAID56_H
+#define RAID56_H
+
+#include <stddef.h>
+
+struct block_layout {
+    int level;
+    int data;
+    int parts;
+    size_t block;
+} typedef block_layout;
+
+int init_layout(block_layout *layout, int level, int data, size_t block);
+void recover_parts(block_layout *layout, unsigned char *parts[], size_t size, int lost[], int count);
+
+#endif
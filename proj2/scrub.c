@@ -0,0 +1,334 @@
+/*
+scrub.c: check the part files of a RAID 2 set in place, without decoding them.
+Worker threads each read a chunk of every part file at a time with pread, check
+the codewords (bit-sliced, like diar) and count the bits found flipped in every
+part file. With -w, corrected chunks are written back with pwrite. A rate limit
+keeps the scrub from starving other I/O on live data. The code comes from
+filename.manifest (see raid.c), or -c if there is none; RAID 5/6 sets have no
+codewords to check and are refused.
+
+Usage:
+    ./scrub -f filename (default: test.txt) [-c code (default: from the manifest)] [-j threads (default: 4)]
+            [-r MB/s (default: no limit)] [-w (write corrections back)]
+*/
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "raid2.h"
+
+#define DEFAULT_IN "test.txt"
+#define DEFAULT_THREADS 4
+
+// number of bytes of every part file checked at a time (a multiple of 8, so
+// the checks work on whole 64-bit words)
+#define CHUNK_SIZE (1 << 20)
+
+// the state shared by the worker threads
+struct scrub {
+    hamming_code code;
+    int fds[MAX_PARTS];
+    uint64_t size;
+    int write_back;
+
+    // bytes per second (0 for no limit), and when the next read may start
+    double rate;
+    double next_time;
+
+    pthread_mutex_t lock;
+    uint64_t next_offset;
+
+    // bits corrected in every part file, and codewords corrected or not
+    uint64_t errors[MAX_PARTS];
+    uint64_t corrected, failed;
+} typedef scrub;
+
+void *scrub_worker(void *arg);
+void scrub_chunk(scrub *s, unsigned char *parts[], uint64_t offset, size_t size, uint64_t errors[], uint64_t *corrected, uint64_t *failed);
+void throttle(scrub *s, size_t bytes);
+double now(void);
+
+void get_code(hamming_code *code, char input_path[], char code_name[]);
+void check_part_count(hamming_code *code, char input_path[]);
+
+void get_args(int argc, char **argv, char *input_path, char *code_name, int *threads, double *rate, int *write_back);
+
+int main(int argc, char **argv) {
+    char input_path[128] = { 0 }, code_name[32] = { 0 };
+    int threads = DEFAULT_THREADS;
+    pthread_t workers[64];
+    scrub s = { 0 };
+
+    /* setup */
+
+    get_args(argc, argv, input_path, code_name, &threads, &s.rate, &s.write_back);
+
+    // checking (let alone correcting) against the wrong code garbles the
+    // part files, so the code is never guessed
+    get_code(&s.code, input_path, code_name);
+    check_part_count(&s.code, input_path);
+
+    if (open_part_files(s.fds, input_path, s.code.parts, s.write_back ? O_RDWR : O_RDONLY) > 0) {
+        printf("Missing part files of %s, rebuild them with diar -R\n", input_path);
+        exit(1);
+    }
+
+    // the part files should all be the same size; a short one reads as zeros
+    for (int i = 0; i < s.code.parts; i++) {
+        struct stat st;
+
+        if (fstat(s.fds[i], &st) == 0 && (uint64_t)st.st_size > s.size) s.size = st.st_size;
+    }
+
+    pthread_mutex_init(&s.lock, NULL);
+    s.next_time = now();
+
+    /* scrubbing */
+
+    for (int t = 0; t < threads; t++) {
+        pthread_create(&workers[t], NULL, scrub_worker, &s);
+    }
+
+    for (int t = 0; t < threads; t++) {
+        pthread_join(workers[t], NULL);
+    }
+
+    /* report */
+
+    for (int i = 0; i < s.code.parts; i++) {
+        printf("%s.part%d: %llu bits flipped\n", input_path, i, (unsigned long long)s.errors[i]);
+        close(s.fds[i]);
+    }
+
+    printf("%llu codewords corrected%s, %llu with more errors than could be corrected\n",
+           (unsigned long long)s.corrected, s.write_back ? " and written back" : "",
+           (unsigned long long)s.failed);
+
+    pthread_mutex_destroy(&s.lock);
+
+    return 0;
+}
+
+// set up the code of the set `input_path`: the one in its manifest, which
+// -c (`code_name`, if given) has to agree with, or without a manifest, the
+// one -c gives. Exits if there is none, or the set isn't RAID 2.
+void get_code(hamming_code *code, char input_path[], char code_name[]) {
+    manifest m = { 0 };
+    hamming_code given;
+    int have_manifest = read_manifest(input_path, &m);
+
+    free(m.crcs);
+
+    if (code_name[0] != 0 && !init_code(&given, code_name)) {
+        printf("Unknown code: %s\n", code_name);
+        exit(1);
+    }
+
+    if (!have_manifest && code_name[0] == 0) {
+        printf("No manifest for %s, give the code with -c\n", input_path);
+        exit(1);
+    }
+
+    if (!have_manifest) {
+        *code = given;
+        return;
+    }
+
+    if (m.level != 2) {
+        printf("%s is RAID %d, only RAID 2 part files can be scrubbed\n", input_path, m.level);
+        exit(1);
+    }
+
+    if (code_name[0] != 0 && (given.parts != m.parts || given.data != m.data)) {
+        printf("Code %s doesn't match the manifest of %s (%d,%d)\n", code_name, input_path, m.parts, m.data);
+        exit(1);
+    }
+
+    char name[32];
+
+    snprintf(name, sizeof(name), "%d,%d", m.parts, m.data);
+
+    if (!init_code(code, name)) {
+        printf("Unknown code in the manifest of %s: %s\n", input_path, name);
+        exit(1);
+    }
+}
+
+// exit unless the set `input_path` has exactly the part files of `code`
+// (open_part_files() finds the missing ones)
+void check_part_count(hamming_code *code, char input_path[]) {
+    char path[256] = { 0 };
+
+    snprintf(path, sizeof(path), "%s.part%d", input_path, code->parts);
+
+    if (access(path, F_OK) == 0) {
+        printf("%s has more part files than the %d of code %d,%d\n", input_path, code->parts, code->parts, code->data);
+        exit(1);
+    }
+}
+
+// worker thread: scrub the next chunk until there are none left, then add
+// its counts to the totals
+void *scrub_worker(void *arg) {
+    scrub *s = arg;
+    unsigned char *parts[MAX_PARTS];
+    uint64_t errors[MAX_PARTS] = { 0 }, corrected = 0, failed = 0;
+
+    for (int i = 0; i < s->code.parts; i++) {
+        parts[i] = alloc_buffer(CHUNK_SIZE);
+    }
+
+    while (1) {
+        pthread_mutex_lock(&s->lock);
+        uint64_t offset = s->next_offset;
+        s->next_offset += CHUNK_SIZE;
+        pthread_mutex_unlock(&s->lock);
+
+        if (offset >= s->size) break;
+
+        size_t size = s->size - offset < CHUNK_SIZE ? s->size - offset : CHUNK_SIZE;
+
+        throttle(s, size * s->code.parts);
+        scrub_chunk(s, parts, offset, size, errors, &corrected, &failed);
+    }
+
+    pthread_mutex_lock(&s->lock);
+
+    for (int i = 0; i < s->code.parts; i++) {
+        s->errors[i] += errors[i];
+        free(parts[i]);
+    }
+
+    s->corrected += corrected;
+    s->failed += failed;
+
+    pthread_mutex_unlock(&s->lock);
+
+    return NULL;
+}
+
+// check `size` bytes of every part file from `offset` on, counting the bits
+// corrected in every part in errors[] and the codewords in `corrected` and
+// `failed` (see correct_code()). With write back, the parts that had errors
+// are written back corrected.
+void scrub_chunk(scrub *s, unsigned char *parts[], uint64_t offset, size_t size, uint64_t errors[], uint64_t *corrected, uint64_t *failed) {
+    size_t padded = (size + 7) & ~(size_t)7;
+    int dirty[MAX_PARTS] = { 0 };
+
+    for (int i = 0; i < s->code.parts; i++) {
+        size_t got = read_part(s->fds[i], parts[i], size, offset);
+
+        memset(parts[i] + got, 0, padded - got);
+    }
+
+    for (size_t k = 0; k < padded; k += 8) {
+        uint64_t words[MAX_PARTS], checked[MAX_PARTS];
+
+        for (int i = 0; i < s->code.parts; i++) {
+            memcpy(&words[i], parts[i] + k, 8);
+            checked[i] = words[i];
+        }
+
+        // clean words (the common case) are left alone
+        uint64_t mask = correct_code(&s->code, checked, 1, failed);
+
+        if (mask == 0) continue;
+
+        *corrected += __builtin_popcountll(mask);
+
+        for (int i = 0; i < s->code.parts; i++) {
+            if (checked[i] == words[i]) continue;
+
+            errors[i] += __builtin_popcountll(checked[i] ^ words[i]);
+            memcpy(parts[i] + k, &checked[i], 8);
+            dirty[i] = 1;
+        }
+    }
+
+    if (!s->write_back) return;
+
+    for (int i = 0; i < s->code.parts; i++) {
+        if (dirty[i]) write_part(s->fds[i], parts[i], size, offset);
+    }
+}
+
+// wait until `bytes` more bytes can be read under the rate limit
+void throttle(scrub *s, size_t bytes) {
+    if (s->rate <= 0) return;
+
+    pthread_mutex_lock(&s->lock);
+    double start = s->next_time > now() ? s->next_time : now();
+    s->next_time = start + bytes / s->rate;
+    pthread_mutex_unlock(&s->lock);
+
+    double wait = start - now();
+
+    if (wait > 0) {
+        struct timespec ts = { (time_t)wait, (long)((wait - (time_t)wait) * 1e9) };
+
+        nanosleep(&ts, NULL);
+    }
+}
+
+// seconds on a monotonic clock
+double now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// process the command line options (or fall back to default values):
+//      -f <path>: file the part files were made from
+//      -c <parts,data>: code the part files were written with (see raid.c),
+//          needed if there is no manifest
+//      -j <threads>: number of worker threads (1-64)
+//      -r <MB/s>: read no faster than this (all part files together)
+//      -w: write corrected chunks back to the part files
+void get_args(int argc, char **argv, char *input_path, char *code_name, int *threads, double *rate, int *write_back) {
+    int opt;
+
+    while ((opt = getopt(argc, argv, "f:c:j:r:w")) != -1) {
+
+        switch (opt) {
+            case 'f':
+                strcpy(input_path, optarg);
+                break;
+            case 'c':
+                snprintf(code_name, 32, "%s", optarg);
+                break;
+            case 'j':
+                *threads = atoi(optarg);
+
+                if (*threads < 1 || *threads > 64) {
+                    printf("Invalid number of threads: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'r':
+                *rate = atof(optarg) * (1 << 20);
+                break;
+            case 'w':
+                *write_back = 1;
+                break;
+            default:
+                printf("Usage: %s [-f filename] [-c code] [-j threads] [-r MB/s] [-w]\n", argv[0]);
+
+                exit(1);
+        }
+
+    }
+
+    // use default values if no input
+    if (input_path[0] == 0) {
+        strcpy(input_path, DEFAULT_IN);
+    }
+}